@@ -1,9 +1,15 @@
 // C implementations of image processing functions
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "imgproc.h"
 #include "image.h"
+#include "imgproc_rows.h"
 
 // TODO: define your helper functions here
 
@@ -11,40 +17,38 @@ int64_t square(int64_t x) {
     return x * x;
 }
 
+// keeps only the red and alpha components of a pixel
+static uint32_t red_and_alpha(uint32_t pixel) {
+  return pixel & 0xFF0000FFU; // bits 24 to 31 (red) and bits 0 to 7 (alpha)
+}
+
+// keeps only the green and alpha components of a pixel
+static uint32_t green_and_alpha(uint32_t pixel) {
+  return pixel & 0x00FF00FFU; // bits 16 to 23 (green) and bits 0 to 7 (alpha)
+}
+
+// keeps only the blue and alpha components of a pixel
+static uint32_t blue_and_alpha(uint32_t pixel) {
+  return pixel & 0x0000FFFFU; // bits 8 to 15 (blue) and bits 0 to 7 (alpha)
+}
+
+IMGPROC_POINTWISE_ROW_FN(red_row, red_and_alpha)
+IMGPROC_POINTWISE_ROW_FN(green_row, green_and_alpha)
+IMGPROC_POINTWISE_ROW_FN(blue_row, blue_and_alpha)
+
 // extracts the red component of an image
 void imgproc_red( struct Image *input_img, struct Image *output_img ) {
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      uint32_t pixel = input_img->data[i * input_img->width + j];
-      uint32_t r = (pixel >> 24) & 0xFF; // extracting bits 24 to 31, red component
-      uint32_t a = pixel & 0xFF; // extracting bits 0 to 7, alpha component
-      output_img->data[i * input_img->width + j] = (r << 24) | a;
-    }
-  }
+  imgproc_for_each_row(input_img, output_img, input_img->height, red_row, NULL);
 }
 
 // extracts the green component of an image
 void imgproc_green( struct Image *input_img, struct Image *output_img ) {
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      uint32_t pixel = input_img->data[i * input_img->width + j];
-      uint32_t g = (pixel >> 16) & 0xFF; // extracting bits 16 to 23, green component
-      uint32_t a = pixel & 0xFF; // extracting bits 0 to 7, alpha component
-      output_img->data[i * input_img->width + j] = (g << 16) | a;
-    }
-  }
+  imgproc_for_each_row(input_img, output_img, input_img->height, green_row, NULL);
 }
 
 // extracts the blue component of an image
 void imgproc_blue( struct Image *input_img, struct Image *output_img ) {
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      uint32_t pixel = input_img->data[i * input_img->width + j];
-      uint32_t b = (pixel >> 8) & 0xFF; // extracting bits 8 to 15, green component
-      uint32_t a = pixel & 0xFF; // extracting bits 0 to 7, alpha component
-      output_img->data[i * input_img->width + j] = (b << 8) | a;
-    }
-  }
+  imgproc_for_each_row(input_img, output_img, input_img->height, blue_row, NULL);
 }
 
 // calculates gradient of a pixel wrt to a row or column length for imgproc_fade()
@@ -101,6 +105,285 @@ int32_t compute_index(struct Image *img, int32_t col, int32_t row) {
     return row * img->width + col;
 }
 
+IMGPROC_POINTWISE_ROW_FN(grayscale_row_scalar, to_grayscale)
+
+#if defined(__x86_64__) || defined(__i386__)
+// Vectorized grayscale: the weighted sum 79 * r + 49 * b is computed with a
+// 16-bit multiply-add on the (r, b) pair of each pixel, and 128 * g is a shift,
+// so the result is bit-identical to to_grayscale().
+
+// Convert the 4 pixels in p to grayscale
+static inline __m128i grayscale_x4_sse2(__m128i p) {
+  const __m128i byte_mask = _mm_set1_epi32(0xFF);
+  __m128i rb = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0x00FF00FF));
+  __m128i g = _mm_and_si128(_mm_srli_epi32(p, 16), byte_mask);
+  __m128i sum = _mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32((79 << 16) | 49)), _mm_slli_epi32(g, 7));
+  __m128i y = _mm_srli_epi32(sum, 8);
+  __m128i yyy = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(y, 24), _mm_slli_epi32(y, 16)), _mm_slli_epi32(y, 8));
+  return _mm_or_si128(yyy, _mm_and_si128(p, byte_mask));
+}
+
+static void grayscale_row_sse2(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  (void) arg;
+  const uint32_t *in = imgproc_row_ptr(input_img, row);
+  uint32_t *out = imgproc_row_ptr(output_img, row);
+  int32_t width = input_img->width, j = 0;
+
+  for (; j + 4 <= width; j += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *) (in + j));
+    _mm_storeu_si128((__m128i *) (out + j), grayscale_x4_sse2(p));
+  }
+  for (; j < width; j++) {
+    out[j] = to_grayscale(in[j]);
+  }
+}
+
+// Convert the 8 pixels in p to grayscale
+__attribute__((target("avx2")))
+static inline __m256i grayscale_x8_avx2(__m256i p) {
+  const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+  __m256i rb = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0x00FF00FF));
+  __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 16), byte_mask);
+  __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(rb, _mm256_set1_epi32((79 << 16) | 49)), _mm256_slli_epi32(g, 7));
+  __m256i y = _mm256_srli_epi32(sum, 8);
+  __m256i yyy = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(y, 24), _mm256_slli_epi32(y, 16)), _mm256_slli_epi32(y, 8));
+  return _mm256_or_si256(yyy, _mm256_and_si256(p, byte_mask));
+}
+
+__attribute__((target("avx2")))
+static void grayscale_row_avx2(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  (void) arg;
+  const uint32_t *in = imgproc_row_ptr(input_img, row);
+  uint32_t *out = imgproc_row_ptr(output_img, row);
+  int32_t width = input_img->width, j = 0;
+
+  for (; j + 8 <= width; j += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *) (in + j));
+    _mm256_storeu_si256((__m256i *) (out + j), grayscale_x8_avx2(p));
+  }
+  for (; j < width; j++) {
+    out[j] = to_grayscale(in[j]);
+  }
+}
+#endif
+
+// Choose the grayscale row kernel for this CPU. The IMGPROC_SIMD environment
+// variable ("scalar", "sse2" or "avx2") can force a particular kernel; a
+// kernel the CPU doesn't support falls back to the next narrower one.
+static imgproc_row_fn select_grayscale_row_for_cpu(void) {
+  const char *forced = getenv("IMGPROC_SIMD");
+  if (forced != NULL && strcmp(forced, "scalar") == 0) {
+    return grayscale_row_scalar;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  int want_avx2 = forced == NULL || strcmp(forced, "avx2") == 0;
+  int want_sse2 = want_avx2 || strcmp(forced, "sse2") == 0;
+  if (!want_sse2) {
+    // not a known kernel name: choose as if it weren't set
+    want_avx2 = want_sse2 = 1;
+  }
+  if (want_avx2 && __builtin_cpu_supports("avx2")) {
+    return grayscale_row_avx2;
+  }
+  if (want_sse2 && __builtin_cpu_supports("sse2")) {
+    return grayscale_row_sse2;
+  }
+#endif
+  return grayscale_row_scalar;
+}
+
+static pthread_once_t s_grayscale_once = PTHREAD_ONCE_INIT;
+static imgproc_row_fn s_grayscale_row;
+
+static void init_grayscale_row(void) {
+  s_grayscale_row = select_grayscale_row_for_cpu();
+}
+
+// The grayscale row kernel, chosen on first use
+static imgproc_row_fn select_grayscale_row(void) {
+  pthread_once(&s_grayscale_once, init_grayscale_row);
+  return s_grayscale_row;
+}
+
+// Row kernel for imgproc_rgb(): input row i is read once and fills all four
+// quadrants of output rows i and i + height
+static void rgb_row(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  (void) arg;
+  int32_t width = input_img->width, j = 0;
+  const uint32_t *src = imgproc_row_ptr(input_img, row);
+  uint32_t *top = imgproc_row_ptr(output_img, row);
+  uint32_t *bottom = imgproc_row_ptr(output_img, row + input_img->height);
+
+#if defined(__x86_64__) || defined(__i386__)
+  const __m128i red_mask = _mm_set1_epi32((int) 0xFF0000FFU);
+  const __m128i green_mask = _mm_set1_epi32(0x00FF00FF);
+  const __m128i blue_mask = _mm_set1_epi32(0x0000FFFF);
+  for (; j + 4 <= width; j += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *) (src + j));
+    _mm_storeu_si128((__m128i *) (top + j), p);
+    _mm_storeu_si128((__m128i *) (top + width + j), _mm_and_si128(p, red_mask));
+    _mm_storeu_si128((__m128i *) (bottom + j), _mm_and_si128(p, green_mask));
+    _mm_storeu_si128((__m128i *) (bottom + width + j), _mm_and_si128(p, blue_mask));
+  }
+#endif
+  for (; j < width; j++) {
+    uint32_t pixel = src[j];
+    top[j] = pixel;                              // A: original
+    top[j + width] = red_and_alpha(pixel);       // B: red
+    bottom[j] = green_and_alpha(pixel);          // C: green
+    bottom[j + width] = blue_and_alpha(pixel);   // D: blue
+  }
+}
+
+// The fade is separable: the scale applied to pixel (i, j) is
+// gradient(i, height) * gradient(j, width), so one table of row gradients
+// and one table of column gradients are computed per image.
+struct FadeTables {
+  int64_t *row_grad;
+  int64_t *col_grad;
+};
+
+// floor(x / 10^12) for 0 <= x < 2^48, computed by multiplying with the
+// fixed-point reciprocal ceil(2^88 / 10^12), which is exact over that range
+// (Granlund & Montgomery, "Division by Invariant Integers using
+// Multiplication"). x is at most 10^6 * 10^6 * 255 < 2^48.
+#define FADE_RECIP        309485009821346ULL
+#define FADE_RECIP_SHIFT  88
+
+// Same result as modified_color_comp(t_r, t_c, c) for scale = t_r * t_c
+static inline uint32_t fade_color_comp(uint64_t scale, uint32_t c) {
+#ifdef __SIZEOF_INT128__
+  return (uint32_t) (((unsigned __int128) (scale * c) * FADE_RECIP) >> FADE_RECIP_SHIFT);
+#else
+  return (uint32_t) ((scale * c) / 1000000000000ULL);
+#endif
+}
+
+// Allocate and fill the gradient tables of the fade for an image of the
+// given size. Returns 0 if they can't be allocated. (Each table has a
+// spare entry, so that an empty image does not depend on malloc(0).)
+static int init_fade_tables(struct FadeTables *tables, int32_t width, int32_t height) {
+  tables->row_grad = (int64_t *) malloc(((size_t) height + 1) * sizeof(int64_t));
+  tables->col_grad = (int64_t *) malloc(((size_t) width + 1) * sizeof(int64_t));
+  if (tables->row_grad == NULL || tables->col_grad == NULL) {
+    return 0;
+  }
+
+  for (int32_t i = 0; i < height; i++) {
+    tables->row_grad[i] = gradient(i, height);
+  }
+  for (int32_t j = 0; j < width; j++) {
+    tables->col_grad[j] = gradient(j, width);
+  }
+  return 1;
+}
+
+static void cleanup_fade_tables(struct FadeTables *tables) {
+  free(tables->row_grad);
+  free(tables->col_grad);
+}
+
+// Row kernel for imgproc_fade()
+static void fade_row(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  struct FadeTables *tables = arg;
+  const uint32_t *in = imgproc_row_ptr(input_img, row);
+  uint32_t *out = imgproc_row_ptr(output_img, row);
+  uint64_t grad_row = tables->row_grad[row];
+
+  for (int32_t j = 0; j < input_img->width; j++) {
+    uint32_t pixel = in[j];
+    uint64_t scale = grad_row * tables->col_grad[j];
+    out[j] = make_pixel(fade_color_comp(scale, get_r(pixel)),
+                        fade_color_comp(scale, get_g(pixel)),
+                        fade_color_comp(scale, get_b(pixel)),
+                        get_a(pixel));
+  }
+}
+
+// The kaleidoscope folds each output coordinate t into the top-left
+// quadrant (t < half, or else size - 1 - t, with half = ceil(size / 2)),
+// and output pixel (row, col) is the input pixel at (min, max) of the
+// folded coordinates. So the top-left quadrant of the output is wedge A
+// of the input (on and above the diagonal) plus its transpose (below
+// the diagonal), the top-right quadrant is the top-left one with each
+// row reversed, and the bottom half is the top half upside down.
+#define KALEIDOSCOPE_TILE 32
+
+struct KaleidoscopeArgs {
+  int32_t size;
+  int32_t half;
+};
+
+// Row kernel for the top half of the output of imgproc_kaleidoscope().
+// "row" is the index of a band of KALEIDOSCOPE_TILE rows, so that the
+// part below the diagonal is transposed one tile at a time: a tile of
+// input rows is read sequentially while the tile of output rows being
+// written stays in cache.
+static void kaleidoscope_top_band(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  struct KaleidoscopeArgs *args = arg;
+  int32_t size = args->size, half = args->half;
+  int32_t first = row * KALEIDOSCOPE_TILE;
+  int32_t last = (first + KALEIDOSCOPE_TILE < half) ? first + KALEIDOSCOPE_TILE : half;
+
+  // wedge A: row r from the diagonal to the middle column, as is
+  for (int32_t r = first; r < last; r++) {
+    memcpy(imgproc_row_ptr(output_img, r) + r, imgproc_row_ptr(input_img, r) + r,
+           (half - r) * sizeof(uint32_t));
+  }
+
+  // below the diagonal: output (r, c) is input (c, r) for c < r
+  for (int32_t tile = 0; tile < last; tile += KALEIDOSCOPE_TILE) {
+    int32_t tile_end = (tile + KALEIDOSCOPE_TILE < last) ? tile + KALEIDOSCOPE_TILE : last;
+    for (int32_t c = tile; c < tile_end; c++) {
+      const uint32_t *in = imgproc_row_ptr(input_img, c);
+      for (int32_t r = (c + 1 > first) ? c + 1 : first; r < last; r++) {
+        output_img->data[(size_t) r * size + c] = in[r];
+      }
+    }
+  }
+
+  // top-right quadrant: output (r, half + k) is output (r, size - half - 1 - k)
+  for (int32_t r = first; r < last; r++) {
+    uint32_t *out = imgproc_row_ptr(output_img, r);
+    for (int32_t c = half; c < size; c++) {
+      out[c] = out[size - 1 - c];
+    }
+  }
+}
+
+// Row kernel for the bottom half of the output of imgproc_kaleidoscope():
+// output row half + row is a copy of the top half row it mirrors
+static void kaleidoscope_bottom_row(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  (void) input_img;
+  struct KaleidoscopeArgs *args = arg;
+  int32_t dst = args->half + row;
+  memcpy(imgproc_row_ptr(output_img, dst), imgproc_row_ptr(output_img, args->size - 1 - dst),
+         args->size * sizeof(uint32_t));
+}
+
+// One step of a fused sequence of pointwise transformations
+struct PointwiseStep {
+  imgproc_row_fn kernel;
+  void *arg;
+};
+
+struct FusedPass {
+  int count;
+  struct PointwiseStep *steps;
+};
+
+// Row kernel for imgproc_fused_pointwise(): the first step reads the input
+// row, and the following ones transform the output row in place while it
+// is still in cache. (Pointwise row kernels read each pixel before writing
+// the same position, so they can take the same image as input and output.)
+static void fused_row(struct Image *input_img, struct Image *output_img, int32_t row, void *arg) {
+  struct FusedPass *pass = arg;
+  pass->steps[0].kernel(input_img, output_img, row, pass->steps[0].arg);
+  for (int i = 1; i < pass->count; i++) {
+    pass->steps[i].kernel(output_img, output_img, row, pass->steps[i].arg);
+  }
+}
 
 // ---- End of helper functions ----
 
@@ -110,24 +393,11 @@ int32_t compute_index(struct Image *img, int32_t col, int32_t row) {
 // Parameters:
 //   input_img  - pointer to the input Image
 //   output_img - pointer to the output Image (in which the transformed
-//                pixels should be stored)
+//                pixels should be stored; see imgproc_output_size())
 void imgproc_grayscale( struct Image *input_img, struct Image *output_img ) {
-  // TODO: use to_grayscale() in for loop
-
-  output_img->width = input_img->width;
-  output_img->height = input_img->height;
+  assert(output_img->width == input_img->width && output_img->height == input_img->height);
 
-  output_img->data = (uint32_t*) malloc(output_img->height * output_img->width * sizeof(uint32_t));
-  if (output_img->data == NULL) {
-    return; // if memory allocation fails
-  }
-
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      uint32_t pixel = input_img->data[i * input_img->width + j];
-      output_img->data[i * input_img->width + j] = to_grayscale(pixel); 
-    }
-  }
+  imgproc_for_each_row(input_img, output_img, input_img->height, select_grayscale_row(), NULL);
 }
 
 // Render an output image containing 4 replicas of the original image,
@@ -154,64 +424,15 @@ void imgproc_grayscale( struct Image *input_img, struct Image *output_img ) {
 //
 // Parameters:
 //   input_img - pointer to the input Image
-//   output_img - pointer to the output Image (which will have
+//   output_img - pointer to the output Image (which must have
 //                width and height twice the width/height of the
 //                input image)
 void imgproc_rgb(struct Image *input_img, struct Image *output_img) {
-  // Set the dimensions of the output image
-  output_img->height = 2 * input_img->height;
-  output_img->width = 2 * input_img->width;
-
-  // Allocate memory for the output image data
-  output_img->data = (uint32_t *)malloc(output_img->width * output_img->height * sizeof(uint32_t));
-  if (output_img->data == NULL) {
-    // Handle memory allocation failure
-    return;
-  }
-
-  // Initialize the red, green, and blue images
-  struct Image red_image, green_image, blue_image;
-  img_init(&red_image, input_img->width, input_img->height);
-  img_init(&green_image, input_img->width, input_img->height);
-  img_init(&blue_image, input_img->width, input_img->height);
-
-  // Apply the color extraction functions
-  imgproc_red(input_img, &red_image);
-  imgproc_green(input_img, &green_image);
-  imgproc_blue(input_img, &blue_image);
-
-  // Copy the original image (A) to the top-left quadrant
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      output_img->data[i * output_img->width + j] = input_img->data[i * input_img->width + j];
-    }
-  }
-
-  // Copy the red image (B) to the top-right quadrant
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      output_img->data[i * output_img->width + (j + input_img->width)] = red_image.data[i * red_image.width + j];
-    }
-  }
-
-  // Copy the green image (C) to the bottom-left quadrant
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      output_img->data[(i + input_img->height) * output_img->width + j] = green_image.data[i * green_image.width + j];
-    }
-  }
+  assert(output_img->width == 2 * input_img->width && output_img->height == 2 * input_img->height);
 
-  // Copy the blue image (D) to the bottom-right quadrant
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      output_img->data[(i + input_img->height) * output_img->width + (j + input_img->width)] = blue_image.data[i * blue_image.width + j];
-    }
-  }
-
-  // Clean up the temporary images
-  img_cleanup(&red_image);
-  img_cleanup(&green_image);
-  img_cleanup(&blue_image);
+  // Each input row produces one row of every quadrant, so the input is
+  // read only once and no intermediate images are needed
+  imgproc_for_each_row(input_img, output_img, input_img->height, rgb_row, NULL);
 }
 
 // Render a "faded" version of the input image.
@@ -219,34 +440,23 @@ void imgproc_rgb(struct Image *input_img, struct Image *output_img) {
 // See the assignment description for an explanation of how this transformation
 // should work.
 //
-// This transformation always succeeds.
-//
 // Parameters:
 //   input_img - pointer to the input Image
-//   output_img - pointer to the output Image
-void imgproc_fade( struct Image *input_img, struct Image *output_img ) {
-  // TODO: implement
-
-  output_img->width = input_img->width;
-  output_img->height = input_img->height;
-
-  output_img->data = (uint32_t*) malloc(output_img->height * output_img->width * sizeof(uint32_t));
-  if (output_img->data == NULL) {
-    return; // if memory allocation fails
+//   output_img - pointer to the output Image (see imgproc_output_size())
+//
+// Returns:
+//   1 if successful, 0 if memory could not be allocated
+int imgproc_fade( struct Image *input_img, struct Image *output_img ) {
+  assert(output_img->width == input_img->width && output_img->height == input_img->height);
+
+  struct FadeTables tables;
+  int ok = init_fade_tables(&tables, input_img->width, input_img->height);
+  if (ok) {
+    imgproc_for_each_row(input_img, output_img, input_img->height, fade_row, &tables);
   }
 
-  for (int j = 0; j < input_img->width; j++) {
-    for (int i = 0; i < input_img->height; i++) {
-      uint32_t pixel = input_img->data[i * input_img->width + j];
-      uint32_t r = get_r(pixel), g = get_g(pixel), b = get_b(pixel), a = get_a(pixel);
-      int64_t grad_row = gradient(i, input_img->height);
-      int64_t grad_col = gradient(j, input_img->width);
-      uint32_t new_r = modified_color_comp(grad_row, grad_col, r);
-      uint32_t new_g = modified_color_comp(grad_row, grad_col, g);
-      uint32_t new_b = modified_color_comp(grad_row, grad_col, b);
-      output_img->data[i * input_img->width + j] = make_pixel(new_r, new_g, new_b, a);
-    }
-  }
+  cleanup_fade_tables(&tables);
+  return ok;
 }
 
 // Render a "kaleidoscope" transformation of input_img in output_img.
@@ -283,69 +493,81 @@ void imgproc_fade( struct Image *input_img, struct Image *output_img ) {
 // Parameters:
 //   input_img  - pointer to the input Image
 //   output_img - pointer to the output Image (in which the transformed
-//                pixels should be stored)
+//                pixels should be stored; see imgproc_output_size())
 //
 // Returns:
 //   1 if successful, 0 if the transformation fails because the
-//   width and height of input_img are not the same.
+//   width and height of input_img are not the same (or output_img
+//   does not have the same dimensions as input_img).
 int imgproc_kaleidoscope(struct Image *input_img, struct Image *output_img) {
   // first check if image is square
   if (input_img->width != input_img->height) {
       return 0;  
   }
-  
-  output_img->width = input_img->width;
-  output_img->height = input_img->height;
-  
-  int size = input_img->width;
-  // Handling of odd dimensions
-  int effective_size = (size % 2 == 1) ? size + 1 : size;
-  int half = effective_size / 2;
-
-  // Allocate memory for output
-  output_img->data = (uint32_t*) malloc(output_img->height * output_img->width * sizeof(uint32_t));
-  if (output_img->data == NULL) {
-    return 0;  
+  if (output_img->width != input_img->width || output_img->height != input_img->height) {
+    return 0;
   }
 
-  // Process each pixel
-  for (int y = 0; y < size; y++) {
-    for (int x = 0; x < size; x++) {
-      int src_x = x;
-      int src_y = y;
-      
-      // Handle quadrants
-      if (x >= half) {
-        // Mirror horizontally for right half
-        src_x = size - 1 - x;
-      }
-      if (y >= half) {
-        // Mirror vertically for bottom half
-        src_y = size - 1 - y;
-      }
+  // Handling of odd dimensions: the middle row and column belong to
+  // the top-left quadrant
+  struct KaleidoscopeArgs args;
+  args.size = input_img->width;
+  args.half = (args.size + 1) / 2;
 
-      //diagonal reflection 
-      if (src_y > src_x) {
-        // if it's below the diagonal then swap
-        int temp = src_x;
-        src_x = src_y;
-        src_y = temp;
-      }
+  // The bottom half copies rows of the top half, so it is done after
+  int32_t num_bands = (args.half + KALEIDOSCOPE_TILE - 1) / KALEIDOSCOPE_TILE;
+  imgproc_for_each_row(input_img, output_img, num_bands, kaleidoscope_top_band, &args);
+  imgproc_for_each_row(input_img, output_img, args.size - args.half, kaleidoscope_bottom_row, &args);
 
-      // Ensure we don't access out of bounds 
-      if (src_x >= size || src_y >= size) {
-        src_x = (src_x >= size) ? size - 1 : src_x;
-        src_y = (src_y >= size) ? size - 1 : src_y;
-      }
+  return 1; 
+}
+
+// Apply a sequence of pointwise transformations in a single pass over
+// the image (see imgproc.h).
+int imgproc_fused_pointwise(struct Image *input_img, struct Image *output_img,
+                            const char *const *transformations, int count) {
+  assert(output_img->width == input_img->width && output_img->height == input_img->height);
 
-      // Get source pixel and copy 
-      int src_index = compute_index(input_img, src_x, src_y);
-      int dst_index = compute_index(output_img, x, y);
-      
-      uint32_t pixel = input_img->data[src_index];
-      output_img->data[dst_index] = pixel;
+  if (count <= 0) {
+    return 0;
+  }
+
+  struct PointwiseStep *steps = (struct PointwiseStep *) malloc(count * sizeof(struct PointwiseStep));
+  if (steps == NULL) {
+    return 0;
+  }
+
+  // every fade step shares one set of gradient tables
+  struct FadeTables tables = { NULL, NULL };
+  int ok = 1;
+  for (int i = 0; i < count && ok; i++) {
+    const char *name = transformations[i];
+    steps[i].arg = NULL;
+    if (strcmp(name, "grayscale") == 0) {
+      steps[i].kernel = select_grayscale_row();
+    } else if (strcmp(name, "fade") == 0) {
+      if (tables.row_grad == NULL) {
+        ok = init_fade_tables(&tables, input_img->width, input_img->height);
+      }
+      steps[i].kernel = fade_row;
+      steps[i].arg = &tables;
+    } else if (strcmp(name, "red") == 0) {
+      steps[i].kernel = red_row;
+    } else if (strcmp(name, "green") == 0) {
+      steps[i].kernel = green_row;
+    } else if (strcmp(name, "blue") == 0) {
+      steps[i].kernel = blue_row;
+    } else {
+      ok = 0;
     }
   }
 
-  return 1; 
-}
\ No newline at end of file
+  if (ok) {
+    struct FusedPass pass = { count, steps };
+    imgproc_for_each_row(input_img, output_img, input_img->height, fused_row, &pass);
+  }
+
+  cleanup_fade_tables(&tables);
+  free(steps);
+  return ok;
+}
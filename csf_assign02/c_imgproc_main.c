@@ -4,11 +4,16 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include "imgproc.h"
+#include "imgproc_rows.h"
 
 struct Transformation {
   const char *name;
   int (*apply)( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+  int pointwise;  // can be fused with neighbouring pointwise steps of a chain
 };
 
 int apply_rgb( struct Image *input_img, struct Image *output_img, int argc, char **argv );
@@ -17,60 +22,264 @@ int apply_fade( struct Image *input_img, struct Image *output_img, int argc, cha
 int apply_kaleidoscope( struct Image *input_img, struct Image *output_img, int argc, char **argv );
 
 static const struct Transformation s_transformations[] = {
-  { "rgb", apply_rgb },
-  { "grayscale", apply_grayscale },
-  { "fade", apply_fade },
-  { "kaleidoscope", apply_kaleidoscope },
-  { NULL, NULL },
+  { "rgb", apply_rgb, 0 },
+  { "grayscale", apply_grayscale, 1 },
+  { "fade", apply_fade, 1 },
+  { "kaleidoscope", apply_kaleidoscope, 0 },
+  { NULL, NULL, 0 },
 };
 
 void usage( const char *progname ) {
   fprintf( stderr, "Error: invalid command-line arguments\n" );
-  fprintf( stderr, "Usage: %s <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Usage: %s [options] <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "       %s [options] --batch <manifest>\n", progname );
+  fprintf( stderr, "<transform> may be a comma-separated chain, such as grayscale,fade\n" );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  --threads N   use N threads (0 = one per CPU, default 1)\n" );
+  fprintf( stderr, "  --profile P   output compression: fast, balanced (default) or small\n" );
+  fprintf( stderr, "  --batch M     run the jobs listed in file M (- for stdin), one\n" );
+  fprintf( stderr, "                \"<transform> <input img> <output img> [args...]\" per line\n" );
+  fprintf( stderr, "  --stats       report the time spent in each stage, and the\n" );
+  fprintf( stderr, "                amount of data processed and peak memory use\n" );
+  fprintf( stderr, "  --stats-json  the same, as a JSON object\n" );
   exit( 1 );
 }
 
-// Make a new empty image.
-// If transformation is "rgb", then the new image will
-// have width and height twice that of the input image,
-// otherwise the output image will be the same dimensions as
-// the input image.
-struct Image *create_output_img( struct Image *input_img, const char *transformation ) {
-  struct Image *out_img;
-  int32_t out_w = input_img->width, out_h = input_img->height;
+// Find the transformation with the given name, or return NULL
+const struct Transformation *find_transformation( const char *name ) {
+  for ( int i = 0; s_transformations[i].name != NULL; ++i )
+    if ( strcmp( s_transformations[i].name, name ) == 0 )
+      return &s_transformations[i];
+  return NULL;
+}
 
-  if ( strcmp( transformation, "rgb" ) == 0 ) {
-    out_w *= 2;
-    out_h *= 2;
+// Set the dimensions of img, reallocating its pixel buffer only if
+// it is smaller than width * height pixels. Returns 0 on failure.
+static int reserve_image( struct Image *img, size_t *capacity, int32_t width, int32_t height ) {
+  size_t num_pixels = (size_t) width * height;
+  if ( num_pixels > *capacity ) {
+    img_cleanup( img );
+    *capacity = 0;
+    if ( img_alloc( img, width, height ) != IMG_SUCCESS ) {
+      img->data = NULL;
+      return 0;
+    }
+    *capacity = num_pixels;
   }
+  img->width = width;
+  img->height = height;
+  return 1;
+}
 
-  // Allocate Image object
-  out_img = (struct Image *) malloc( sizeof( struct Image ) );
-  if ( out_img == NULL )
-    return NULL;
+// A transformation, or a chain of transformations applied one after
+// another (written "grayscale,fade,kaleidoscope" on the command line)
+#define MAX_CHAIN_LENGTH 16
+
+struct Chain {
+  int length;
+  const struct Transformation *steps[MAX_CHAIN_LENGTH];
+};
 
-  // Set data to NULL for now
-  out_img->data = NULL;
+// The two image buffers a chain is run in
+struct ChainBuffers {
+  struct Image img[2];
+  size_t capacity[2];  // in pixels
+};
 
-  // Attempt to initialize the Image object by calling img_init
-  if ( img_init( out_img, out_w, out_h ) != IMG_SUCCESS ) {
-    free( out_img );
-    return NULL;
+// Parse a comma-separated list of transformation names.
+// Returns 0 if a name is not known or the chain is too long.
+int parse_chain( const char *spec, struct Chain *chain ) {
+  char name[64];
+  chain->length = 0;
+  for ( ;; ) {
+    size_t len = strcspn( spec, "," );
+    if ( len >= sizeof( name ) || chain->length == MAX_CHAIN_LENGTH )
+      return 0;
+    memcpy( name, spec, len );
+    name[len] = '\0';
+    if ( ( chain->steps[chain->length++] = find_transformation( name ) ) == NULL )
+      return 0;
+    if ( spec[len] == '\0' )
+      return 1;
+    spec += len + 1;
   }
+}
+
+// Apply the steps of a chain one after another, starting from the image
+// in buffers->img[0]. The two buffers take turns as the input and the
+// output of each step, so that intermediate images are neither encoded
+// nor allocated (a buffer only grows when a step's output does not fit).
+// Consecutive pointwise steps are fused into a single pass over the image
+// (see imgproc_fused_pointwise).
+// Returns the index of the buffer holding the final image, or -1 if a
+// step failed.
+int run_chain( const struct Chain *chain, struct ChainBuffers *buffers, int argc, char **argv ) {
+  int cur = 0;
+  for ( int i = 0; i < chain->length; ) {
+    const struct Transformation *xform = chain->steps[i];
+    struct Image *in = &buffers->img[cur], *out = &buffers->img[1 - cur];
+    int32_t out_w, out_h;
+
+    if ( !imgproc_output_size( xform->name, in, &out_w, &out_h ) ||
+         !reserve_image( out, &buffers->capacity[1 - cur], out_w, out_h ) ) {
+      fprintf( stderr, "Error: couldn't create output image object\n" );
+      return -1;
+    }
+
+    // the run of pointwise steps starting here
+    const char *names[MAX_CHAIN_LENGTH];
+    int run = 0;
+    while ( i + run < chain->length && chain->steps[i + run]->pointwise ) {
+      names[run] = chain->steps[i + run]->name;
+      run++;
+    }
 
-  // Success!
-  return out_img;
+    if ( run > 1 && imgproc_fused_pointwise( in, out, names, run ) ) {
+      i += run;
+    } else {
+      if ( !xform->apply( in, out, argc, argv ) )
+        return -1;
+      i++;
+    }
+    cur = 1 - cur;
+  }
+  return cur;
 }
 
-// Free memory allocated to given Image object
-void cleanup_image( struct Image *img ) {
-  if ( img != NULL ) {
-    img_cleanup( img );
-    free( img );
+// Compression settings for the output image (set by --profile)
+static struct ImageWriteOptions s_write_opts;
+
+// Format of the statistics printed at the end (set by --stats and --stats-json)
+enum StatsFormat { STATS_NONE, STATS_TEXT, STATS_JSON };
+static enum StatsFormat s_stats_format;
+
+// Statistics printed at the end: the wall time of each stage (summed
+// over the images, in seconds), and what image.c collected while
+// reading and writing the images
+struct RunStats {
+  int num_images, num_failed;
+  double total_time, read_time, transform_time, write_time;
+  uint64_t pixels_transformed;  // pixels of the input images of the transformations
+  struct ImageStats read_io, write_io;
+};
+
+// Monotonic wall clock time in seconds
+static double now_sec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double per_sec( double count, double seconds ) {
+  return ( seconds > 0.0 ) ? count / seconds : 0.0;
+}
+
+// Print the statistics in the format chosen with --stats or --stats-json
+void print_stats( const struct RunStats *stats ) {
+  const struct ImageStats *in = &stats->read_io, *out = &stats->write_io;
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+  unsigned long long peak_bytes = (unsigned long long) usage.ru_maxrss * 1024;  // ru_maxrss is in KiB
+
+  if ( s_stats_format == STATS_JSON ) {
+    printf( "{\"images\": %d, \"failed\": %d, \"total_s\": %.6f, \"peak_rss_bytes\": %llu,\n",
+            stats->num_images, stats->num_failed, stats->total_time, peak_bytes );
+    printf( " \"read\": {\"wall_s\": %.6f, \"inflate_s\": %.6f, \"unfilter_s\": %.6f, \"convert_s\": %.6f, "
+            "\"bytes_in\": %llu, \"pixels\": %llu, \"pixels_per_s\": %.0f},\n",
+            stats->read_time, in->inflate_time, in->unfilter_time, in->read_convert_time,
+            (unsigned long long) in->bytes_read, (unsigned long long) in->pixels_read,
+            per_sec( in->pixels_read, stats->read_time ) );
+    printf( " \"transform\": {\"wall_s\": %.6f, \"pixels\": %llu, \"pixels_per_s\": %.0f},\n",
+            stats->transform_time, (unsigned long long) stats->pixels_transformed,
+            per_sec( stats->pixels_transformed, stats->transform_time ) );
+    printf( " \"write\": {\"wall_s\": %.6f, \"convert_s\": %.6f, \"filter_s\": %.6f, \"deflate_s\": %.6f, "
+            "\"bytes_out\": %llu, \"pixels\": %llu, \"pixels_per_s\": %.0f}}\n",
+            stats->write_time, out->write_convert_time, out->filter_time, out->deflate_time,
+            (unsigned long long) out->bytes_written, (unsigned long long) out->pixels_written,
+            per_sec( out->pixels_written, stats->write_time ) );
+    return;
+  }
+
+  printf( "images:      %d", stats->num_images );
+  if ( stats->num_failed > 0 )
+    printf( " (%d failed)", stats->num_failed );
+  printf( "\n" );
+  printf( "read:        %10.3f ms %10.1f Mpixels/s %12llu bytes in\n", stats->read_time * 1e3,
+          per_sec( in->pixels_read, stats->read_time ) / 1e6, (unsigned long long) in->bytes_read );
+  printf( "  inflate:   %10.3f ms\n", in->inflate_time * 1e3 );
+  printf( "  unfilter:  %10.3f ms\n", in->unfilter_time * 1e3 );
+  printf( "  convert:   %10.3f ms\n", in->read_convert_time * 1e3 );
+  printf( "transform:   %10.3f ms %10.1f Mpixels/s\n", stats->transform_time * 1e3,
+          per_sec( stats->pixels_transformed, stats->transform_time ) / 1e6 );
+  printf( "write:       %10.3f ms %10.1f Mpixels/s %12llu bytes out\n", stats->write_time * 1e3,
+          per_sec( out->pixels_written, stats->write_time ) / 1e6, (unsigned long long) out->bytes_written );
+  printf( "  convert:   %10.3f ms\n", out->write_convert_time * 1e3 );
+  printf( "  filter:    %10.3f ms\n", out->filter_time * 1e3 );
+  printf( "  deflate:   %10.3f ms\n", out->deflate_time * 1e3 );
+  printf( "total:       %10.3f ms\n", stats->total_time * 1e3 );
+  printf( "peak memory: %10.1f MiB\n", peak_bytes / ( 1024.0 * 1024.0 ) );
+}
+
+// Manifest of jobs for batch mode (set by --batch)
+static const char *s_batch_manifest;
+
+int run_batch( const char *progname, const char *manifest );
+
+// Parse the options preceding the transformation name.
+// Returns the index of the first non-option argument.
+int parse_options( int argc, char **argv ) {
+  img_write_profile( "balanced", &s_write_opts );
+
+  int i = 1;
+  while ( i < argc && strncmp( argv[i], "--", 2 ) == 0 ) {
+    if ( strcmp( argv[i], "--threads" ) == 0 && i + 1 < argc ) {
+      char *end;
+      long num_threads = strtol( argv[i + 1], &end, 10 );
+      if ( *argv[i + 1] == '\0' || *end != '\0' || num_threads < 0 || num_threads > IMG_MAX_THREADS )
+        usage( argv[0] );
+      imgproc_set_num_threads( (int) num_threads );
+      i += 2;
+    } else if ( strcmp( argv[i], "--profile" ) == 0 && i + 1 < argc ) {
+      if ( !img_write_profile( argv[i + 1], &s_write_opts ) )
+        usage( argv[0] );
+      i += 2;
+    } else if ( strcmp( argv[i], "--batch" ) == 0 && i + 1 < argc ) {
+      s_batch_manifest = argv[i + 1];
+      i += 2;
+    } else if ( strcmp( argv[i], "--stats" ) == 0 ) {
+      s_stats_format = STATS_TEXT;
+      i++;
+    } else if ( strcmp( argv[i], "--stats-json" ) == 0 ) {
+      s_stats_format = STATS_JSON;
+      i++;
+    } else {
+      usage( argv[0] );
+    }
   }
+
+  // the output image is compressed with the same number of threads
+  // (one per CPU may be more than the writer accepts)
+  int num_threads = imgproc_get_num_threads();
+  s_write_opts.threads = num_threads < IMG_MAX_THREADS ? num_threads : IMG_MAX_THREADS;
+  return i;
 }
 
 int main( int argc, char **argv ) {
+  const char *progname = argv[0];
+  int first_arg = parse_options( argc, argv );
+
+  if ( s_batch_manifest != NULL ) {
+    if ( first_arg != argc )
+      usage( progname );
+    return run_batch( progname, s_batch_manifest );
+  }
+
+  // The transformation functions see the remaining arguments only,
+  // with the program name in argv[0]
+  argc -= first_arg - 1;
+  argv += first_arg - 1;
+  argv[0] = (char *) progname;
+
   if ( argc < 4 )
     usage( argv[0] );
 
@@ -78,58 +287,328 @@ int main( int argc, char **argv ) {
   const char *input_filename = argv[2];
   const char *output_filename = argv[3];
 
-  // Allocate and read the input image
-  struct Image *input_img = (struct Image *) malloc( sizeof( struct Image ) );
-  if ( input_img == NULL ) {
-    fprintf( stderr, "Error: couldn't allocate input image\n" );
-    exit( 1 );
-  }
-  if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
-    fprintf( stderr, "Error: couldn't read input image\n" );
-    free( input_img );
+  // find transformation(s)
+  struct Chain chain;
+  if ( !parse_chain( transformation, &chain ) ) {
+    fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
     return 1;
   }
 
-  // Create output Image object
-  struct Image *output_img = create_output_img( input_img, transformation );
-  if ( output_img == NULL ) {
-    fprintf( stderr, "Error: couldn't create output image object\n" );
-    cleanup_image( input_img );
-    return 1;
-  }
+  struct RunStats stats;
+  memset( &stats, 0, sizeof( stats ) );
+  struct ImageStats io;
+  memset( &io, 0, sizeof( io ) );
+  if ( s_stats_format != STATS_NONE )
+    img_set_stats( &io );
+  double start = now_sec();
 
-  // find transformation
-  const struct Transformation *xform = NULL;
-  for ( int i = 0; s_transformations[i].name != NULL; ++i )
-    if ( strcmp( s_transformations[i].name, transformation ) == 0 ) {
-      xform = &s_transformations[i];
-      break;
-    }
+  // Read the input image into the first buffer
+  struct ChainBuffers buffers;
+  memset( &buffers, 0, sizeof( buffers ) );
+  int result = -1;
+  bool success = img_read( input_filename, &buffers.img[0] ) == IMG_SUCCESS;
+  double read_done = now_sec();
 
-  int success;
-
-  if ( xform != NULL ) {
-    // apply the transformation!
-    success = xform->apply( input_img, output_img, argc, argv ) != 0;
+  if ( success ) {
+    // apply the transformation(s)!
+    buffers.capacity[0] = (size_t) buffers.img[0].width * buffers.img[0].height;
+    stats.pixels_transformed = buffers.capacity[0];
+    result = run_chain( &chain, &buffers, argc, argv );
+    success = result >= 0;
   } else {
-    fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
-    success = 0;
+    fprintf( stderr, "Error: couldn't read input image\n" );
   }
+  double transform_done = now_sec();
 
   if ( success ) {
     // Write output image
-    if ( img_write( output_filename, output_img ) != IMG_SUCCESS ) {
+    if ( img_write_with_options( output_filename, &buffers.img[result], &s_write_opts ) != IMG_SUCCESS ) {
       fprintf( stderr, "Error: couldn't write output image\n" );
       success = false;
     }
   }
 
-  cleanup_image( input_img );
-  cleanup_image( output_img );
+  if ( s_stats_format != STATS_NONE ) {
+    double end = now_sec();
+    img_set_stats( NULL );
+    stats.num_images = 1;
+    stats.num_failed = success ? 0 : 1;
+    stats.total_time = end - start;
+    stats.read_time = read_done - start;
+    stats.transform_time = transform_done - read_done;
+    stats.write_time = end - transform_done;
+    stats.read_io = stats.write_io = io;
+    print_stats( &stats );
+  }
+
+  img_cleanup( &buffers.img[0] );
+  img_cleanup( &buffers.img[1] );
 
   return success ? 0 : 1;
 }
 
+// Batch mode
+//
+// The jobs go through a pipeline of three stages, each in its own
+// thread: the decode thread reads the manifest and the input images,
+// the main thread applies the transformations, and the encode thread
+// writes the output images. So while one image is transformed, the
+// next one is decoded and the previous one is encoded. A job occupies
+// a slot while it is in the pipeline; the chain buffers of each slot
+// are kept for the following jobs. Each stage thread also keeps its zlib stream from one
+// image to the next (see img_release_streams).
+
+#define BATCH_NUM_SLOTS 3
+#define BATCH_MAX_ARGS  32
+
+struct BatchJob {
+  int end;       // set on the slot marking the end of the manifest
+  int ok;        // cleared when a stage fails
+  int line_num;  // manifest line of the job, for error messages
+  char *line;    // the manifest line (argv points into it)
+  size_t line_size;
+  int argc;
+  char *argv[BATCH_MAX_ARGS + 1];  // argv[0] is the program name
+  int too_many_args;  // set if the line had more arguments than fit in argv
+  struct Chain chain;
+  struct ChainBuffers buffers;
+  int result;    // index of the buffer holding the output image
+};
+
+// Queue of jobs waiting for a stage
+struct BatchQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct BatchJob *jobs[BATCH_NUM_SLOTS];
+  int head, count;
+};
+
+struct Batch {
+  const char *progname;
+  FILE *manifest;
+  int line_num;
+  struct BatchQueue free_slots, decoded, transformed;
+  int num_jobs, num_failed;
+  struct RunStats stats;  // each stage thread updates its own fields
+};
+
+static void queue_init( struct BatchQueue *q ) {
+  pthread_mutex_init( &q->lock, NULL );
+  pthread_cond_init( &q->cond, NULL );
+  q->head = q->count = 0;
+}
+
+static void queue_destroy( struct BatchQueue *q ) {
+  pthread_mutex_destroy( &q->lock );
+  pthread_cond_destroy( &q->cond );
+}
+
+// There are only BATCH_NUM_SLOTS jobs, so a queue is never full
+static void queue_push( struct BatchQueue *q, struct BatchJob *job ) {
+  pthread_mutex_lock( &q->lock );
+  q->jobs[( q->head + q->count ) % BATCH_NUM_SLOTS] = job;
+  q->count++;
+  pthread_cond_signal( &q->cond );
+  pthread_mutex_unlock( &q->lock );
+}
+
+static struct BatchJob *queue_pop( struct BatchQueue *q ) {
+  pthread_mutex_lock( &q->lock );
+  while ( q->count == 0 )
+    pthread_cond_wait( &q->cond, &q->lock );
+  struct BatchJob *job = q->jobs[q->head];
+  q->head = ( q->head + 1 ) % BATCH_NUM_SLOTS;
+  q->count--;
+  pthread_mutex_unlock( &q->lock );
+  return job;
+}
+
+// Read the next job from the manifest into job, skipping blank lines
+// and comments (starting with '#'). Returns 0 at the end of the manifest.
+static int read_job( struct Batch *batch, struct BatchJob *job ) {
+  while ( getline( &job->line, &job->line_size, batch->manifest ) >= 0 ) {
+    job->line_num = ++batch->line_num;
+
+    char *save;
+    job->argc = 1;
+    job->argv[0] = (char *) batch->progname;
+    job->too_many_args = 0;
+    for ( char *arg = strtok_r( job->line, " \t\r\n", &save ); arg != NULL;
+          arg = strtok_r( NULL, " \t\r\n", &save ) ) {
+      if ( job->argc == BATCH_MAX_ARGS ) {
+        job->too_many_args = 1;
+        break;
+      }
+      job->argv[job->argc++] = arg;
+    }
+    job->argv[job->argc] = NULL;
+
+    if ( job->argc > 1 && job->argv[1][0] != '#' )
+      return 1;
+  }
+  return 0;
+}
+
+// Read the input image of a job into its slot's input buffer
+static int decode_job( struct BatchJob *job ) {
+  struct ImageReader reader;
+  if ( img_reader_open( &reader, job->argv[2] ) != IMG_SUCCESS )
+    return 0;
+
+  struct Image *img = &job->buffers.img[0];
+  int ok = reserve_image( img, &job->buffers.capacity[0], reader.width, reader.height );
+  for ( int32_t i = 0; ok && i < reader.height; i++ )
+    ok = img_reader_read_row( &reader, imgproc_row_ptr( img, i ) ) == IMG_SUCCESS;
+
+  img_reader_close( &reader );
+  return ok;
+}
+
+static void *decode_thread( void *arg ) {
+  struct Batch *batch = arg;
+  if ( s_stats_format != STATS_NONE )
+    img_set_stats( &batch->stats.read_io );
+
+  for ( ;; ) {
+    struct BatchJob *job = queue_pop( &batch->free_slots );
+    if ( !read_job( batch, job ) ) {
+      job->end = 1;
+      queue_push( &batch->decoded, job );
+      break;
+    }
+
+    job->ok = 0;
+    if ( job->too_many_args ) {
+      fprintf( stderr, "Error: line %d: too many arguments\n", job->line_num );
+    } else if ( job->argc < 4 ) {
+      fprintf( stderr, "Error: line %d: expected <transform> <input img> <output img>\n", job->line_num );
+    } else if ( !parse_chain( job->argv[1], &job->chain ) ) {
+      fprintf( stderr, "Error: line %d: unknown transformation '%s'\n", job->line_num, job->argv[1] );
+    } else {
+      double start = now_sec();
+      job->ok = decode_job( job );
+      batch->stats.read_time += now_sec() - start;
+      if ( !job->ok )
+        fprintf( stderr, "Error: line %d: couldn't read input image %s\n", job->line_num, job->argv[2] );
+    }
+    queue_push( &batch->decoded, job );
+  }
+
+  img_set_stats( NULL );
+  img_release_streams();
+  return NULL;
+}
+
+static void *encode_thread( void *arg ) {
+  struct Batch *batch = arg;
+  if ( s_stats_format != STATS_NONE )
+    img_set_stats( &batch->stats.write_io );
+
+  for ( ;; ) {
+    struct BatchJob *job = queue_pop( &batch->transformed );
+    if ( job->end )
+      break;
+
+    if ( job->ok ) {
+      double start = now_sec();
+      if ( img_write_with_options( job->argv[3], &job->buffers.img[job->result], &s_write_opts ) != IMG_SUCCESS ) {
+        fprintf( stderr, "Error: line %d: couldn't write output image %s\n", job->line_num, job->argv[3] );
+        job->ok = 0;
+      }
+      batch->stats.write_time += now_sec() - start;
+    }
+
+    // only this thread updates the counts, and only the main thread
+    // reads them, after joining it
+    batch->num_jobs++;
+    if ( !job->ok )
+      batch->num_failed++;
+    queue_push( &batch->free_slots, job );
+  }
+
+  img_set_stats( NULL );
+  img_release_streams();
+  return NULL;
+}
+
+// Run the jobs listed in the named manifest file ("-" for stdin),
+// and report how many images per second were processed (or the
+// statistics chosen with --stats or --stats-json).
+// Returns the exit code: 0 if every job succeeded, otherwise 1.
+int run_batch( const char *progname, const char *manifest ) {
+  struct Batch batch;
+  struct BatchJob slots[BATCH_NUM_SLOTS];
+  pthread_t decoder, encoder;
+
+  memset( &batch, 0, sizeof( batch ) );
+  batch.progname = progname;
+  batch.manifest = ( strcmp( manifest, "-" ) == 0 ) ? stdin : fopen( manifest, "r" );
+  if ( batch.manifest == NULL ) {
+    fprintf( stderr, "Error: couldn't open manifest %s\n", manifest );
+    return 1;
+  }
+
+  queue_init( &batch.free_slots );
+  queue_init( &batch.decoded );
+  queue_init( &batch.transformed );
+  memset( slots, 0, sizeof( slots ) );
+  for ( int i = 0; i < BATCH_NUM_SLOTS; i++ )
+    queue_push( &batch.free_slots, &slots[i] );
+
+  double start = now_sec();
+
+  if ( pthread_create( &decoder, NULL, decode_thread, &batch ) != 0 ||
+       pthread_create( &encoder, NULL, encode_thread, &batch ) != 0 ) {
+    fprintf( stderr, "Error: couldn't start batch threads\n" );
+    exit( 1 );
+  }
+
+  // transform stage
+  for ( ;; ) {
+    struct BatchJob *job = queue_pop( &batch.decoded );
+    if ( job->ok ) {
+      double transform_start = now_sec();
+      batch.stats.pixels_transformed += (uint64_t) job->buffers.img[0].width * job->buffers.img[0].height;
+      job->result = run_chain( &job->chain, &job->buffers, job->argc, job->argv );
+      job->ok = job->result >= 0;
+      batch.stats.transform_time += now_sec() - transform_start;
+    }
+    queue_push( &batch.transformed, job );
+    if ( job->end )
+      break;
+  }
+
+  pthread_join( decoder, NULL );
+  pthread_join( encoder, NULL );
+
+  double elapsed = now_sec() - start;
+  if ( s_stats_format != STATS_NONE ) {
+    batch.stats.num_images = batch.num_jobs;
+    batch.stats.num_failed = batch.num_failed;
+    batch.stats.total_time = elapsed;
+    print_stats( &batch.stats );
+  } else {
+    printf( "%d images in %.3f s (%.1f images/s)", batch.num_jobs, elapsed,
+            per_sec( batch.num_jobs, elapsed ) );
+    if ( batch.num_failed > 0 )
+      printf( ", %d failed", batch.num_failed );
+    printf( "\n" );
+  }
+
+  if ( batch.manifest != stdin )
+    fclose( batch.manifest );
+  for ( int i = 0; i < BATCH_NUM_SLOTS; i++ ) {
+    free( slots[i].line );
+    img_cleanup( &slots[i].buffers.img[0] );
+    img_cleanup( &slots[i].buffers.img[1] );
+  }
+  queue_destroy( &batch.free_slots );
+  queue_destroy( &batch.decoded );
+  queue_destroy( &batch.transformed );
+
+  return ( batch.num_failed == 0 ) ? 0 : 1;
+}
+
 int apply_rgb( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
   (void) argc;
   (void) argv;
@@ -147,8 +626,10 @@ int apply_grayscale( struct Image *input_img, struct Image *output_img, int argc
 int apply_fade( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
   (void) argc;
   (void) argv;
-  imgproc_fade( input_img, output_img );
-  return 1;
+  int success = imgproc_fade( input_img, output_img );
+  if ( !success )
+    fprintf( stderr, "Error: fade transformation failed\n" );
+  return success;
 }
 
 int apply_kaleidoscope( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
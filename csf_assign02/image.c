@@ -1,9 +1,22 @@
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "pnglite.h"
 #include "image.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-int png_init_called;
+#if IMG_MAX_THREADS != PNG_MAX_THREADS
+#error "IMG_MAX_THREADS must match PNG_MAX_THREADS"
+#endif
 
 int is_little_endian(void) {
   int32_t x = 1;
@@ -16,138 +29,614 @@ uint32_t byteswap(uint32_t val) {
   return result;
 }
 
-int img_init(struct Image *img, int32_t width, int32_t height) {
-  int num_pixels = width * height;
+// Byteswap num_pixels pixels from src to dst (which may be the same buffer)
+static void swap_pixels_scalar(uint32_t *dst, const uint32_t *src, size_t num_pixels) {
+  for (size_t i = 0; i < num_pixels; i++) {
+    dst[i] = byteswap(src[i]);
+  }
+}
 
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
-  if (pixel_data == NULL) {
-    return IMG_ERR_MALLOC_FAILED;
+// Expand num_pixels packed RGB triples at src to RGBA pixels (with opaque
+// alpha) at dst
+static void expand_rgb_scalar(uint32_t *dst, const unsigned char *src, size_t num_pixels) {
+  for (size_t i = 0; i < num_pixels; i++) {
+    uint32_t r = src[i*3 + 0];
+    uint32_t g = src[i*3 + 1];
+    uint32_t b = src[i*3 + 2];
+    dst[i] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// pshufb versions of the above, 4 pixels at a time (x86 is little endian)
+
+__attribute__((target("ssse3")))
+static void swap_pixels_ssse3(uint32_t *dst, const uint32_t *src, size_t num_pixels) {
+  const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  size_t i = 0;
+  for (; i + 4 <= num_pixels; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(p, swap));
   }
+  swap_pixels_scalar(dst + i, src + i, num_pixels - i);
+}
 
-  // initialize every pixel to opaque black
-  for (int32_t i = 0; i < num_pixels; i++) {
-    pixel_data[i] = 0x000000FFU;
+__attribute__((target("ssse3")))
+static void expand_rgb_ssse3(uint32_t *dst, const unsigned char *src, size_t num_pixels) {
+  // in memory, a pixel is A B G R; alpha lanes are zeroed by the shuffle
+  const __m128i expand = _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  size_t i = 0;
+
+  // each iteration loads 16 bytes but consumes only 12 (4 pixels), so
+  // stop while at least 6 pixels (18 bytes) remain
+  for (; i + 6 <= num_pixels; i += 4) {
+    __m128i rgb = _mm_loadu_si128((const __m128i *) (src + i*3));
+    __m128i rgba = _mm_or_si128(_mm_shuffle_epi8(rgb, expand), alpha);
+    _mm_storeu_si128((__m128i *) (dst + i), rgba);
+  }
+  expand_rgb_scalar(dst + i, src + i*3, num_pixels - i);
+}
+#endif
+
+static void (*s_swap_pixels)(uint32_t *dst, const uint32_t *src, size_t num_pixels);
+static void (*s_expand_rgb)(uint32_t *dst, const unsigned char *src, size_t num_pixels);
+
+// Choose the pixel conversion functions for this CPU
+static void select_converters(void) {
+  s_swap_pixels = swap_pixels_scalar;
+  s_expand_rgb = expand_rgb_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    s_swap_pixels = swap_pixels_ssse3;
+    s_expand_rgb = expand_rgb_ssse3;
+  }
+#endif
+}
+
+// Row conversion for png_write_row_converted: byteswap a row of
+// pixels into PNG (big-endian RGBA) order
+static void swap_row_for_png(unsigned char *dst, const unsigned char *src, unsigned len) {
+  s_swap_pixels((uint32_t *) dst, (const uint32_t *) src, len / sizeof(uint32_t));
+}
+
+// Compute the number of pixels of a width x height image. Returns 0 if
+// a dimension is negative, or if the size of the pixels in bytes does
+// not fit in a size_t.
+static int count_pixels(int32_t width, int32_t height, size_t *num_pixels) {
+  size_t bytes;
+  if (width < 0 || height < 0 ||
+      __builtin_mul_overflow((size_t) width, (size_t) height, num_pixels) ||
+      __builtin_mul_overflow(*num_pixels, sizeof(uint32_t), &bytes)) {
+    return 0;
+  }
+  return 1;
+}
+
+// Allocate an IMG_ALIGNMENT-aligned buffer for num_pixels pixels
+// (the result can be freed with free)
+static uint32_t *alloc_pixels(size_t num_pixels) {
+  void *p;
+  if (num_pixels > SIZE_MAX / sizeof(uint32_t) ||
+      posix_memalign(&p, IMG_ALIGNMENT, num_pixels * sizeof(uint32_t)) != 0) {
+    return NULL;
+  }
+  return (uint32_t *) p;
+}
+
+// Set num_pixels pixels to value. The first block is filled directly,
+// and then replicated with memcpy; the block is small enough to stay
+// in the L1 cache while it is being copied.
+static void fill_pixels(uint32_t *data, size_t num_pixels, uint32_t value) {
+  const size_t block = 4096;
+  size_t filled = (num_pixels < block) ? num_pixels : block;
+
+  for (size_t i = 0; i < filled; i++) {
+    data[i] = value;
+  }
+  while (filled < num_pixels) {
+    size_t n = (num_pixels - filled < block) ? num_pixels - filled : block;
+    memcpy(data + filled, data, n * sizeof(uint32_t));
+    filled += n;
+  }
+}
+
+int img_alloc(struct Image *img, int32_t width, int32_t height) {
+  size_t num_pixels;
+  if (!count_pixels(width, height, &num_pixels)) {
+    return IMG_ERR_TOO_LARGE;
+  }
+
+  uint32_t *pixel_data = alloc_pixels(num_pixels);
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
   }
 
-  // success
   img->width = width;
   img->height = height;
   img->data = pixel_data;
   return IMG_SUCCESS;
 }
 
-int img_read(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+int img_init(struct Image *img, int32_t width, int32_t height) {
+  int rc = img_alloc(img, width, height);
+  if (rc != IMG_SUCCESS) {
+    return rc;
   }
 
-  png_t png;
+  // initialize every pixel to opaque black
+  fill_pixels(img->data, (size_t) width * (size_t) height, 0x000000FFU);
+  return IMG_SUCCESS;
+}
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
-    return IMG_ERR_COULD_NOT_OPEN;
+static pthread_once_t s_png_once = PTHREAD_ONCE_INIT;
+
+static void init_png_once(void) {
+  png_init(0, 0);
+  select_converters();
+}
+
+// Initialize pnglite and choose the pixel conversion functions
+// the first time an image is read or written (by any thread)
+static void init_png(void) {
+  pthread_once(&s_png_once, init_png_once);
+}
+
+// zlib streams reused by the images read and written by each thread
+// (see img_release_streams)
+static __thread png_streams_t s_png_streams;
+
+void img_release_streams(void) {
+  png_free_streams(&s_png_streams);
+}
+
+// Statistics of the images read and written by each thread (see
+// img_set_stats), and the pnglite statistics of its open images
+static __thread struct ImageStats *s_stats;
+static __thread png_stats_t s_png_stats;
+
+void img_set_stats(struct ImageStats *stats) {
+  s_stats = stats;
+  memset(&s_png_stats, 0, sizeof(s_png_stats));
+}
+
+// Monotonic wall clock time in seconds
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add the pnglite statistics collected so far to the thread's statistics
+static void collect_png_stats(void) {
+  if (s_stats == NULL) {
+    return;
+  }
+  s_stats->inflate_time += s_png_stats.inflate_time;
+  s_stats->unfilter_time += s_png_stats.unfilter_time;
+  s_stats->write_convert_time += s_png_stats.convert_time;
+  s_stats->filter_time += s_png_stats.filter_time;
+  s_stats->deflate_time += s_png_stats.deflate_time;
+  s_stats->bytes_read += s_png_stats.bytes_read;
+  s_stats->bytes_written += s_png_stats.bytes_written;
+  memset(&s_png_stats, 0, sizeof(s_png_stats));
+}
+
+// Map the named file into memory for reading it from start to end.
+// Returns NULL if the file can't be mapped (for example, if it
+// is empty or is not a regular file).
+static void *map_file(const char *filename, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  void *map = NULL;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
+    } else {
+      *size = st.st_size;
+      madvise(map, *size, MADV_SEQUENTIAL);
+    }
   }
 
+  // the mapping remains valid after the file is closed
+  close(fd);
+  return map;
+}
+
+// Close the input of an ImageReader and free its decoder state
+static void close_input(struct ImageReader *reader) {
+  png_t *png = reader->png;
+  if (reader->map != NULL) {
+    munmap(reader->map, reader->map_size);
+  } else if (png->mem == NULL) {
+    // read with stdio
+    png_close_file(png);
+  }
+  free(png);
+  reader->png = NULL;
+  reader->map = NULL;
+}
+
+// Check that the image opened by an ImageReader is supported, and
+// prepare to decode it. On failure, the input is closed.
+static int begin_reading(struct ImageReader *reader) {
+  png_t *png = reader->png;
+  png_set_streams(png, &s_png_streams);
+  png_set_stats(png, (s_stats != NULL) ? &s_png_stats : NULL);
+
   // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
-    png_close_file(&png);
+  if (!(png->color_type == PNG_TRUECOLOR && png->bpp == 3) &&
+      !(png->color_type == PNG_TRUECOLOR_ALPHA && png->bpp == 4)) {
+    close_input(reader);
     return IMG_ERR_NOT_TRUECOLOR;
   }
-  
-  int num_pixels = png.width * png.height;
 
-  // allocate buffer for pixel data in truecolor RGBA format
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (png_read_begin(png) != PNG_NO_ERROR) {
+    png_read_end(png);
+    close_input(reader);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+  // pnglite rejects dimensions above 2^31 - 1, so they fit in an int32_t
+  reader->width = png->width;
+  reader->height = png->height;
+  return IMG_SUCCESS;
+}
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
+int img_reader_open(struct ImageReader *reader, const char *filename) {
+  init_png();
+
+  png_t *png = (png_t *) malloc(sizeof(png_t));
+  if (png == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  reader->png = png;
+
+  // the compressed data is inflated straight from the mapped file
+  // if possible, otherwise it is read into a buffer
+  reader->map = map_file(filename, &reader->map_size);
+  int rc;
+  if (reader->map != NULL) {
+    rc = png_open_mem_read(png, reader->map, reader->map_size);
+  } else {
+    rc = png_open_file_read(png, filename);
+  }
+  if (rc != PNG_NO_ERROR) {
+    if (reader->map != NULL) {
+      munmap(reader->map, reader->map_size);
     }
+    free(png);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  return begin_reading(reader);
+}
 
-    for (int i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+int img_reader_read_row(struct ImageReader *reader, uint32_t *row) {
+  png_t *png = reader->png;
+  unsigned char *scanline;
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
-    }
+  if (png_read_row(png, &scanline) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_READ;
+  }
 
-    free(pixel_data_raw);
-  } else {
+  double start = (s_stats != NULL) ? now_sec() : 0.0;
+
+  if (png->color_type == PNG_TRUECOLOR) {
+    // PNG pixel data is in RGB form, expand it to add the alpha channel
+    s_expand_rgb(row, scanline, reader->width);
+  } else if (is_little_endian()) {
     // PNG pixel data is already in the correct format,
     // except that the RGBA data is in big-endian form, so we
     // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+    s_swap_pixels(row, (const uint32_t *) scanline, reader->width);
+  } else {
+    memcpy(row, scanline, reader->width * sizeof(uint32_t));
+  }
 
-    if (is_little_endian()) {
-      for (int i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
+  if (s_stats != NULL) {
+    s_stats->read_convert_time += now_sec() - start;
+    s_stats->pixels_read += reader->width;
+  }
+
+  return IMG_SUCCESS;
+}
+
+void img_reader_close(struct ImageReader *reader) {
+  png_read_end(reader->png);
+  collect_png_stats();
+  close_input(reader);
+}
+
+// Read every row of the image opened by an ImageReader into img,
+// and close the reader
+static int read_image(struct ImageReader *reader, struct Image *img) {
+  int rc;
+
+  // allocate buffer for pixel data in truecolor RGBA format
+  size_t width = reader->width, num_pixels;
+  if (!count_pixels(reader->width, reader->height, &num_pixels)) {
+    img_reader_close(reader);
+    return IMG_ERR_TOO_LARGE;
+  }
+  uint32_t *pixel_data = alloc_pixels(num_pixels);
+  if (pixel_data == NULL) {
+    img_reader_close(reader);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // each row is converted to RGBA as soon as it is decoded
+  for (int32_t i = 0; i < reader->height; i++) {
+    rc = img_reader_read_row(reader, pixel_data + i * width);
+    if (rc != IMG_SUCCESS) {
+      img_reader_close(reader);
+      free(pixel_data);
+      return rc;
     }
   }
 
   // communicate pixel data and image dimensions to caller
   img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+  img->width = reader->width;
+  img->height = reader->height;
 
-  png_close_file(&png);
+  img_reader_close(reader);
 
   return IMG_SUCCESS;
 }
 
-int img_write(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+int img_read(const char *filename, struct Image *img) {
+  struct ImageReader reader;
+  int rc = img_reader_open(&reader, filename);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  return read_image(&reader, img);
+}
+
+int img_read_mem(const void *data, size_t size, struct Image *img) {
+  init_png();
+
+  struct ImageReader reader;
+  png_t *png = (png_t *) malloc(sizeof(png_t));
+  if (png == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  reader.png = png;
+  reader.map = NULL;
+
+  if (png_open_mem_read(png, data, size) != PNG_NO_ERROR) {
+    free(png);
+    return IMG_ERR_COULD_NOT_READ;
+  }
+
+  int rc = begin_reading(&reader);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  return read_image(&reader, img);
+}
+
+// Settings of the profiles accepted by img_write_profile
+static const struct {
+  const char *name;
+  struct ImageWriteOptions opts;
+} s_write_profiles[] = {
+  { "fast", { 1, IMG_STRATEGY_RLE, IMG_FILTER_ADAPTIVE, 1 } },
+  { "balanced", { 6, IMG_STRATEGY_DEFAULT, IMG_FILTER_ADAPTIVE, 1 } },
+  { "small", { 9, IMG_STRATEGY_FILTERED, IMG_FILTER_ADAPTIVE, 1 } },
+  { NULL, { 0, 0, 0, 0 } },
+};
+
+int img_write_profile(const char *profile, struct ImageWriteOptions *opts) {
+  for (int i = 0; s_write_profiles[i].name != NULL; i++) {
+    if (strcmp(s_write_profiles[i].name, profile) == 0) {
+      *opts = s_write_profiles[i].opts;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Close the output of an ImageWriter and free its encoder state
+static void close_output(struct ImageWriter *writer) {
+  png_t *png = writer->png;
+  if (png->write_fun == NULL) {
+    // written with stdio
+    png_close_file(png);
+  }
+  free(png);
+  writer->png = NULL;
+}
+
+// Check that an image of the given dimensions can be written as a PNG:
+// a row (4 bytes per pixel, plus the filter type byte) must fit in an int.
+// Done before the output is opened, so that a rejected image doesn't
+// leave an empty file behind.
+static int check_write_size(int32_t width, int32_t height) {
+  if (width < 0 || height < 0 || (size_t) width * 4 + 1 > INT_MAX) {
+    return IMG_ERR_TOO_LARGE;
+  }
+  return IMG_SUCCESS;
+}
+
+// Write the header of the image opened by an ImageWriter, and
+// prepare to encode it. On failure, the output is closed.
+static int begin_writing(struct ImageWriter *writer, int32_t width, int32_t height,
+                         const struct ImageWriteOptions *opts) {
+  if (opts == NULL) {
+    opts = &s_write_profiles[1].opts;
+  }
+  png_write_options_t png_opts = { opts->level, opts->strategy, opts->filter, opts->threads };
+
+  png_set_streams(writer->png, &s_png_streams);
+  png_set_stats(writer->png, (s_stats != NULL) ? &s_png_stats : NULL);
+  int rc = png_write_begin(writer->png, width, height, 8, PNG_TRUECOLOR_ALPHA, &png_opts);
+  if (rc != PNG_NO_ERROR) {
+    close_output(writer);
+    if (rc == PNG_MEMORY_ERROR) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    return (rc == PNG_HEADER_ERROR || rc == PNG_NOT_SUPPORTED) ? IMG_ERR_TOO_LARGE : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  writer->width = width;
+  writer->height = height;
+  return IMG_SUCCESS;
+}
+
+int img_writer_open(struct ImageWriter *writer, const char *filename, int32_t width, int32_t height,
+                    const struct ImageWriteOptions *opts) {
+  init_png();
+
+  int rc = check_write_size(width, height);
+  if (rc != IMG_SUCCESS) {
+    return rc;
   }
 
-  png_t png;
+  png_t *png = (png_t *) malloc(sizeof(png_t));
+  if (png == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  writer->png = png;
 
-  if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
+  if (png_open_file_write(png, filename) != PNG_NO_ERROR) {
+    free(png);
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
+  return begin_writing(writer, width, height, opts);
+}
+
+int img_writer_write_row(struct ImageWriter *writer, const uint32_t *row) {
   // if this is a little endian system, we need to byteswap
   // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  // (which is what PNG requires); this is done as the row is
+  // copied into pnglite's scanline buffer, so no separate byteswapped
+  // copy is needed
+  int rc;
+  if (is_little_endian()) {
+    rc = png_write_row_converted(writer->png, (unsigned char *) row, swap_row_for_png);
+  } else {
+    rc = png_write_row(writer->png, (unsigned char *) row);
+  }
 
-  uint32_t *data_to_write = img->data;
-  int need_byteswap = is_little_endian();
+  if (s_stats != NULL && rc == PNG_NO_ERROR) {
+    s_stats->pixels_written += writer->width;
+  }
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  return (rc == PNG_NO_ERROR) ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int img_writer_close(struct ImageWriter *writer) {
+  int rc = png_write_end(writer->png);
+  collect_png_stats();
+  close_output(writer);
+
+  return (rc == PNG_NO_ERROR) ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int img_write(const char *filename, struct Image *img) {
+  return img_write_with_options(filename, img, NULL);
+}
 
-    int32_t num_pixels = img->width * img->height;
-    for (int32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+// Write every row of img with an ImageWriter, and close the writer
+static int write_image(struct ImageWriter *writer, struct Image *img) {
+  int rc = IMG_SUCCESS;
+
+  // each row is compressed and written out as soon as it is converted
+  size_t width = img->width;
+  for (int32_t i = 0; i < img->height && rc == IMG_SUCCESS; i++) {
+    rc = img_writer_write_row(writer, img->data + i * width);
+  }
+
+  int close_rc = img_writer_close(writer);
+
+  return (rc != IMG_SUCCESS) ? rc : close_rc;
+}
+
+int img_write_with_options(const char *filename, struct Image *img, const struct ImageWriteOptions *opts) {
+  struct ImageWriter writer;
+  int rc = img_writer_open(&writer, filename, img->width, img->height, opts);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  return write_image(&writer, img);
+}
+
+// Growable buffer receiving the PNG data written by img_write_mem
+struct OutputBuffer {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+};
+
+// pnglite write callback appending to an OutputBuffer
+static unsigned write_to_buffer(void *input, size_t size, size_t numel, void *user_pointer) {
+  struct OutputBuffer *out = user_pointer;
+  size_t n = size * numel;
+
+  if (out->capacity - out->len < n) {
+    // double the capacity, so appending is amortized constant time
+    size_t capacity = (out->capacity > 0) ? out->capacity : 65536;
+    while (capacity - out->len < n) {
+      if (capacity > SIZE_MAX / 2) {
+        return 0;
+      }
+      capacity *= 2;
     }
+    unsigned char *data = realloc(out->data, capacity);
+    if (data == NULL) {
+      return 0;
+    }
+    out->data = data;
+    out->capacity = capacity;
   }
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
+  memcpy(out->data + out->len, input, n);
+  out->len += n;
+  return numel;
+}
+
+int img_write_mem(struct Image *img, void **buf, size_t *len) {
+  init_png();
 
-  png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
+  int rc = check_write_size(img->width, img->height);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  struct ImageWriter writer;
+  struct OutputBuffer out = { NULL, 0, 0 };
+  png_t *png = (png_t *) malloc(sizeof(png_t));
+  if (png == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
   }
+  writer.png = png;
+  png_open_write(png, write_to_buffer, &out);
 
-  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  rc = begin_writing(&writer, img->width, img->height, NULL);
+  if (rc == IMG_SUCCESS) {
+    rc = write_image(&writer, img);
+  }
+
+  if (rc != IMG_SUCCESS) {
+    free(out.data);
+    return rc;
+  }
+
+  *buf = out.data;
+  *len = out.len;
+  return IMG_SUCCESS;
 }
 
 void img_cleanup( struct Image *img ) {
@@ -7,8 +7,34 @@
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_COULD_NOT_READ   -5
+#define IMG_ERR_TOO_LARGE        -6  // negative dimensions, or too large to represent
+
+// alignment (in bytes) of the pixel buffers allocated by img_init,
+// img_alloc, and img_read, suitable for aligned SIMD loads and stores
+#define IMG_ALIGNMENT            64
+
+// compression strategies for ImageWriteOptions (these are the
+// values of the corresponding zlib Z_* strategies)
+#define IMG_STRATEGY_DEFAULT      0
+#define IMG_STRATEGY_FILTERED     1
+#define IMG_STRATEGY_HUFFMAN_ONLY 2
+#define IMG_STRATEGY_RLE          3
+
+// PNG filter policies for ImageWriteOptions: a single filter type
+// for every row, or IMG_FILTER_ADAPTIVE to choose one for each row
+#define IMG_FILTER_NONE          0
+#define IMG_FILTER_SUB           1
+#define IMG_FILTER_UP            2
+#define IMG_FILTER_AVERAGE       3
+#define IMG_FILTER_PAETH         4
+#define IMG_FILTER_ADAPTIVE      5
+
+// upper limit on ImageWriteOptions.threads (the same as pnglite's)
+#define IMG_MAX_THREADS          1024
 
 #ifndef ASM_SOURCE
+#include <stddef.h>
 #include <stdint.h>
 
 struct Image {
@@ -17,6 +43,17 @@ struct Image {
   uint32_t *data;
 };
 
+// Settings for compressing PNG images written by img_write_with_options
+// and img_writer_open
+struct ImageWriteOptions {
+  int level;    // compression level, 0 (fastest) to 9 (smallest), -1 for default
+  int strategy; // one of the IMG_STRATEGY_* values
+  int filter;   // one of the IMG_FILTER_* values
+  int threads;  // number of threads compressing the image data (1 = only
+                // the calling thread); large images are split into blocks
+                // compressed concurrently, at a small cost in size
+};
+
 // Initialize an Image struct instance by creating a pixel
 // buffer large enough to accommodate an image of the specified
 // dimensions, initialzing all pixels to opaque black,
@@ -34,6 +71,20 @@ struct Image {
 //   IMG_ERR_* values
 int img_init(struct Image *img, int32_t width, int32_t height);
 
+// Like img_init, but the pixels are left uninitialized. This is
+// useful when every pixel will be overwritten anyway, for example
+// when the image is the output of a transformation.
+//
+// Parameters:
+//   img - pointer to Image instance to initialize
+//   width - image width (number of pixel columns)
+//   height - image height (number of pixel rows)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_alloc(struct Image *img, int32_t width, int32_t height);
+
 // Read PNG image data from a file and initialize the specified
 // Image struct instance.
 //
@@ -47,6 +98,139 @@ int img_init(struct Image *img, int32_t width, int32_t height);
 //   IMG_ERR_* values
 int img_read(const char *filename, struct Image *img);
 
+// Like img_read, but decode a PNG image held in memory.
+//
+// Parameters:
+//   data - pointer to the PNG data (must remain valid during the call)
+//   size - size of the PNG data in bytes
+//   img - pointer to Image struct to initialize with the decoded
+//         image data
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_mem(const void *data, size_t size, struct Image *img);
+
+// State for reading a PNG image one row at a time. Only a few rows
+// of the image are held in memory, so images that are too large to
+// fit in memory can be processed a row (or a few rows) at a time.
+struct ImageReader {
+  int32_t width;
+  int32_t height;
+  void *png;       // decoder state
+  void *map;       // the memory-mapped file, or NULL if it is read with stdio
+  size_t map_size;
+};
+
+// Open a PNG file for reading one row at a time.
+//
+// Parameters:
+//   reader - pointer to ImageReader to initialize; on success,
+//            its width and height fields are set
+//   filename - name of PNG file to read
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_reader_open(struct ImageReader *reader, const char *filename);
+
+// Read the next row of the image (rows are read top to bottom).
+//
+// Parameters:
+//   reader - pointer to ImageReader opened by img_reader_open
+//   row - where to store the row's pixels (reader->width pixels)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_reader_read_row(struct ImageReader *reader, uint32_t *row);
+
+// Close an ImageReader opened by img_reader_open.
+//
+// Parameters:
+//   reader - pointer to ImageReader to close
+void img_reader_close(struct ImageReader *reader);
+
+// Free the zlib streams which the calling thread keeps between the
+// images it reads and writes, so that reading or writing the next
+// image does not have to set up new ones. A thread which has read or
+// written images should call this before it exits.
+void img_release_streams(void);
+
+// Time (in seconds) spent in each stage of reading and writing
+// images, and the amount of data read and written. Reading an image
+// is inflating, unfiltering and converting (byteswapping or expanding)
+// its rows; writing one is converting (byteswapping), filtering and
+// deflating them.
+struct ImageStats {
+  double inflate_time;
+  double unfilter_time;
+  double read_convert_time;
+  double write_convert_time;
+  double filter_time;
+  double deflate_time;
+  uint64_t bytes_read;     // PNG data read
+  uint64_t bytes_written;  // PNG data written
+  uint64_t pixels_read;
+  uint64_t pixels_written;
+};
+
+// Collect statistics about the images which the calling thread reads
+// and writes from now on. The statistics of each image are added to
+// stats (which should be zeroed first) when its reader or writer is
+// closed.
+//
+// Parameters:
+//   stats - pointer to the ImageStats to add to, or NULL to stop
+//           collecting statistics
+void img_set_stats(struct ImageStats *stats);
+
+// State for writing a PNG image one row at a time. Rows are
+// compressed and written out as they arrive, so the whole image
+// never needs to be held in memory.
+struct ImageWriter {
+  int32_t width;
+  int32_t height;
+  void *png; // encoder state
+};
+
+// Open a PNG file for writing one row at a time.
+//
+// Parameters:
+//   writer - pointer to ImageWriter to initialize
+//   filename - name of PNG file to write
+//   width - width of the image
+//   height - height of the image
+//   opts - compression settings, or NULL for the "balanced" profile
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_writer_open(struct ImageWriter *writer, const char *filename, int32_t width, int32_t height,
+                    const struct ImageWriteOptions *opts);
+
+// Write the next row of the image (rows are written top to bottom).
+//
+// Parameters:
+//   writer - pointer to ImageWriter opened by img_writer_open
+//   row - the row's pixels (writer->width pixels)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_writer_write_row(struct ImageWriter *writer, const uint32_t *row);
+
+// Finish writing the image and close the ImageWriter. This must be
+// called even if writing a row failed.
+//
+// Parameters:
+//   writer - pointer to ImageWriter opened by img_writer_open
+//
+// Returns:
+//   IMG_SUCCESS if every row was written successfully, otherwise
+//   one of the IMG_ERR_* values
+int img_writer_close(struct ImageWriter *writer);
+
 // Write pixel data from specified Image struct instance to the
 // named PNG output file.
 //
@@ -60,6 +244,44 @@ int img_read(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int img_write(const char *filename, struct Image *img);
 
+// Like img_write, but with the given compression settings.
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   img - pointer to Image struct with the pixel data to write
+//         to a PNG file
+//   opts - compression settings, or NULL for the "balanced" profile
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_with_options(const char *filename, struct Image *img, const struct ImageWriteOptions *opts);
+
+// Like img_write, but encode the PNG image into a newly allocated
+// memory buffer, which the caller must free.
+//
+// Parameters:
+//   img - pointer to Image struct with the pixel data to encode
+//   buf - receives a pointer to the PNG data
+//   len - receives the size of the PNG data in bytes
+//
+// Returns:
+//   IMG_SUCCESS if successful (*buf and *len are only set in this
+//   case), otherwise one of the IMG_ERR_* values
+int img_write_mem(struct Image *img, void **buf, size_t *len);
+
+// Look up the compression settings of a named profile: "fast"
+// (for scratch outputs), "balanced" (the default), or "small"
+// (for archival outputs).
+//
+// Parameters:
+//   profile - name of the profile
+//   opts - pointer to ImageWriteOptions to fill in
+//
+// Returns:
+//   1 if the profile exists, 0 otherwise
+int img_write_profile(const char *profile, struct ImageWriteOptions *opts);
+
 // De-allocate the dynamically-allocated memory used in the internal
 // representation of the given Image struct. Note that this function
 // does NOT de-allocate the struct Image instance itself (since allocating
@@ -9,13 +9,36 @@
 #include <stdint.h>
 extern uint32_t to_grayscale(uint32_t pixel);
 
+// Output buffers are owned by the caller. Before calling a transformation,
+// the caller sets the output Image's width and height to the values
+// reported by imgproc_output_size() and points its data at a buffer of at
+// least width * height pixels (for example by calling img_init). The
+// transformation writes every output pixel, and never allocates, frees,
+// or resizes the output. This allows one output buffer to be reused
+// across many images.
+
+// Compute the dimensions of the output image produced by a transformation.
+//
+// Parameters:
+//   transformation - name of the transformation ("rgb", "grayscale",
+//                    "fade", or "kaleidoscope")
+//   input_img      - pointer to the input Image
+//   output_width   - where to store the output width
+//   output_height  - where to store the output height
+//
+// Returns:
+//   1 if successful, 0 if the transformation name is not known or the
+//   output dimensions would not fit in an int32_t
+int imgproc_output_size( const char *transformation, const struct Image *input_img,
+                         int32_t *output_width, int32_t *output_height );
+
 // Convert input pixels to grayscale.
 // This transformation always succeeds.
 //
 // Parameters:
 //   input_img  - pointer to the input Image
 //   output_img - pointer to the output Image (in which the transformed
-//                pixels should be stored)
+//                pixels should be stored; see imgproc_output_size())
 void imgproc_grayscale( struct Image *input_img, struct Image *output_img );
 
 // Render an output image containing 4 replicas of the original image,
@@ -42,7 +65,7 @@ void imgproc_grayscale( struct Image *input_img, struct Image *output_img );
 //
 // Parameters:
 //   input_img - pointer to the input Image
-//   output_img - pointer to the output Image (which will have
+//   output_img - pointer to the output Image (which must have
 //                width and height twice the width/height of the
 //                input image)
 void imgproc_rgb( struct Image *input_img, struct Image *output_img );
@@ -52,12 +75,14 @@ void imgproc_rgb( struct Image *input_img, struct Image *output_img );
 // See the assignment description for an explanation of how this transformation
 // should work.
 //
-// This transformation always succeeds.
-//
 // Parameters:
 //   input_img - pointer to the input Image
-//   output_img - pointer to the output Image
-void imgproc_fade( struct Image *input_img, struct Image *output_img );
+//   output_img - pointer to the output Image (see imgproc_output_size())
+//
+// Returns:
+//   1 if successful, 0 if the transformation fails because its
+//   gradient tables can't be allocated (output_img is not written).
+int imgproc_fade( struct Image *input_img, struct Image *output_img );
 
 // Render a "kaleidoscope" transformation of input_img in output_img.
 // The input_img must be square, i.e., the width and height must be
@@ -93,11 +118,12 @@ void imgproc_fade( struct Image *input_img, struct Image *output_img );
 // Parameters:
 //   input_img  - pointer to the input Image
 //   output_img - pointer to the output Image (in which the transformed
-//                pixels should be stored)
+//                pixels should be stored; see imgproc_output_size())
 //
 // Returns:
 //   1 if successful, 0 if the transformation fails because the
-//   width and height of input_img are not the same.
+//   width and height of input_img are not the same (or output_img
+//   does not have the same dimensions as input_img).
 int imgproc_kaleidoscope( struct Image *input_img, struct Image *output_img );
 
 // TODO: add prototypes for your helper functions
@@ -105,6 +131,27 @@ void imgproc_red( struct Image *input_img, struct Image *output_img );
 void imgproc_green( struct Image *input_img, struct Image *output_img );
 void imgproc_blue( struct Image *input_img, struct Image *output_img );
 
+// Apply a sequence of pointwise transformations, in which each output
+// pixel depends only on the input pixel at the same position ("grayscale",
+// "fade", "red", "green" and "blue"), in a single pass over the image:
+// each row is read from input_img once, and goes through every
+// transformation while it is in cache before being stored in output_img.
+// The result is the same as applying the transformations one after another.
+//
+// Parameters:
+//   input_img       - pointer to the input Image
+//   output_img      - pointer to the output Image (with the same
+//                     dimensions as input_img)
+//   transformations - names of the transformations, in order
+//   count           - number of transformations
+//
+// Returns:
+//   1 if successful, 0 if a transformation is not pointwise, memory
+//   could not be allocated, or the implementation does not fuse
+//   transformations (in which case they must be applied one by one)
+int imgproc_fused_pointwise( struct Image *input_img, struct Image *output_img,
+                             const char *const *transformations, int count );
+
 //red component
 uint32_t get_r(uint32_t pixel);
 
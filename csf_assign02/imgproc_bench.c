@@ -0,0 +1,494 @@
+// Throughput benchmark for the image processing functions.
+//
+// Compares the transformations against reference copies of their
+// original implementations (column-major traversal, rgb with three
+// temporary channel images, kaleidoscope computed per pixel), and
+// unfused against fused pointwise transformations, and the C against
+// the assembly language implementations, on a synthetic image. Each
+// case runs in its own child process so that its peak resident set
+// size can be reported separately.
+//
+// Usage: ./imgproc_bench [<size> [<reps>]]
+//   size - width and height of the synthetic image (default 4096)
+//   reps - number of timed repetitions per case (default 3)
+//
+// Usage: ./imgproc_bench sweep [<max size> [<reps>]]
+//   Runs the C and the assembly language implementation of each
+//   transformation on synthetic images of size 64x64, 128x128, ... up
+//   to max size (default 16384), and reports the mean time in ns/pixel,
+//   the memory throughput in GB/s (input plus output bytes), the
+//   relative standard deviation over reps runs (default 5), and whether
+//   both implementations produced the same output. Sizes whose images
+//   would not fit in physical memory are skipped.
+//
+// Usage: ./imgproc_bench encode [<png file>...]
+//   Compares PNG encoding time and output size of the original writer
+//   (unfiltered scanlines, default compression level) and of the
+//   img_write profiles, for each of the given images (default: the
+//   images in input/). "balanced/mt" is the balanced profile compressed
+//   with one thread per online CPU (at least 2).
+//
+// Usage: ./imgproc_bench decode [<png file>...]
+//   Reports PNG decoding (img_read) time for each of the given images
+//   (default: the images in input/)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "imgproc.h"
+#include "pnglite.h"
+
+// The assembly language implementations, renamed with an asm_ prefix
+// (see the Makefile)
+void asm_imgproc_grayscale( struct Image *input_img, struct Image *output_img );
+void asm_imgproc_rgb( struct Image *input_img, struct Image *output_img );
+int asm_imgproc_fade( struct Image *input_img, struct Image *output_img );
+
+// Timing helper: monotonic wall clock time in seconds
+static double now_sec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill img with a deterministic pseudo-random pattern
+static void fill_synthetic( struct Image *img ) {
+  uint32_t state = 0x12345678U;
+  size_t n = (size_t) img->width * img->height;
+  for ( size_t i = 0; i < n; i++ ) {
+    state = state * 1664525U + 1013904223U;
+    img->data[i] = state;
+  }
+}
+
+// Column-major reference traversal (the original loop order)
+static void grayscale_colmajor( struct Image *input_img, struct Image *output_img ) {
+  for ( int j = 0; j < input_img->width; j++ )
+    for ( int i = 0; i < input_img->height; i++ )
+      output_img->data[i * input_img->width + j] = to_grayscale( input_img->data[i * input_img->width + j] );
+}
+
+static void fade_colmajor( struct Image *input_img, struct Image *output_img ) {
+  for ( int j = 0; j < input_img->width; j++ ) {
+    for ( int i = 0; i < input_img->height; i++ ) {
+      uint32_t pixel = input_img->data[i * input_img->width + j];
+      int64_t grad_row = gradient( i, input_img->height );
+      int64_t grad_col = gradient( j, input_img->width );
+      output_img->data[i * input_img->width + j] = make_pixel(
+        modified_color_comp( grad_row, grad_col, get_r( pixel ) ),
+        modified_color_comp( grad_row, grad_col, get_g( pixel ) ),
+        modified_color_comp( grad_row, grad_col, get_b( pixel ) ),
+        get_a( pixel ) );
+    }
+  }
+}
+
+static void red_colmajor( struct Image *input_img, struct Image *output_img ) {
+  for ( int j = 0; j < input_img->width; j++ )
+    for ( int i = 0; i < input_img->height; i++ )
+      output_img->data[i * input_img->width + j] = input_img->data[i * input_img->width + j] & 0xFF0000FFU;
+}
+
+// Original imgproc_rgb: three temporary channel images, then quadrant copies
+static void rgb_unfused( struct Image *in, struct Image *out ) {
+  struct Image red_image, green_image, blue_image;
+  img_init( &red_image, in->width, in->height );
+  img_init( &green_image, in->width, in->height );
+  img_init( &blue_image, in->width, in->height );
+  imgproc_red( in, &red_image );
+  imgproc_green( in, &green_image );
+  imgproc_blue( in, &blue_image );
+  for ( int i = 0; i < in->height; i++ ) {
+    for ( int j = 0; j < in->width; j++ ) {
+      size_t top = (size_t) i * out->width, bottom = (size_t) ( i + in->height ) * out->width;
+      size_t src = (size_t) i * in->width + j;
+      out->data[top + j] = in->data[src];
+      out->data[top + in->width + j] = red_image.data[src];
+      out->data[bottom + j] = green_image.data[src];
+      out->data[bottom + in->width + j] = blue_image.data[src];
+    }
+  }
+  img_cleanup( &red_image );
+  img_cleanup( &green_image );
+  img_cleanup( &blue_image );
+}
+
+// The fades report whether their gradient tables could be allocated,
+// which the benchmark cases don't
+static void fade_rowmajor( struct Image *in, struct Image *out ) {
+  (void) imgproc_fade( in, out );
+}
+
+static void fade_asm( struct Image *in, struct Image *out ) {
+  (void) asm_imgproc_fade( in, out );
+}
+
+// Original kaleidoscope: fold, diagonal swap and clamp for every pixel
+static void kaleidoscope_pixelwise( struct Image *input_img, struct Image *output_img ) {
+  int size = input_img->width;
+  int half = ( size + 1 ) / 2;
+  for ( int row = 0; row < size; row++ ) {
+    int mirrored_y = ( row >= half ) ? size - 1 - row : row;
+    for ( int x = 0; x < size; x++ ) {
+      int src_x = ( x >= half ) ? size - 1 - x : x;
+      int src_y = mirrored_y;
+      if ( src_y > src_x ) {
+        int temp = src_x;
+        src_x = src_y;
+        src_y = temp;
+      }
+      if ( src_x >= size || src_y >= size ) {
+        src_x = ( src_x >= size ) ? size - 1 : src_x;
+        src_y = ( src_y >= size ) ? size - 1 : src_y;
+      }
+      output_img->data[compute_index( output_img, x, row )] = input_img->data[compute_index( input_img, src_x, src_y )];
+    }
+  }
+}
+
+static void kaleidoscope_blocked( struct Image *in, struct Image *out ) {
+  imgproc_kaleidoscope( in, out );
+}
+
+// grayscale then fade, as separate passes (through an intermediate image)
+// and as one fused pass
+static void grayscale_fade_unfused( struct Image *in, struct Image *out ) {
+  struct Image gray;
+  img_alloc( &gray, in->width, in->height );
+  imgproc_grayscale( in, &gray );
+  imgproc_fade( &gray, out );
+  img_cleanup( &gray );
+}
+
+static void grayscale_fade_fused( struct Image *in, struct Image *out ) {
+  static const char *const steps[] = { "grayscale", "fade" };
+  imgproc_fused_pointwise( in, out, steps, 2 );
+}
+
+// PNG output sink which only counts the bytes written
+static unsigned count_bytes( void *input, size_t size, size_t numel, void *user_pointer ) {
+  (void) input;
+  *(size_t *) user_pointer += size * numel;
+  return numel;
+}
+
+// Convert a row of pixels to the big-endian RGBA order PNG requires
+static void swap_row( unsigned char *dst, const unsigned char *src, unsigned len ) {
+  for ( unsigned i = 0; i < len; i += 4 ) {
+    uint32_t pixel;
+    memcpy( &pixel, src + i, 4 );
+    pixel = __builtin_bswap32( pixel );
+    memcpy( dst + i, &pixel, 4 );
+  }
+}
+
+// Encode img with the given compression settings, returning the encoded size
+static size_t encode_png( struct Image *img, const struct ImageWriteOptions *opts ) {
+  png_write_options_t png_opts = { opts->level, opts->strategy, opts->filter, opts->threads };
+  size_t written = 0;
+  png_t png;
+  png_open_write( &png, count_bytes, &written );
+  png_write_begin( &png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, &png_opts );
+  for ( int32_t i = 0; i < img->height; i++ )
+    png_write_row_converted( &png, (unsigned char *) ( img->data + (size_t) i * img->width ), swap_row );
+  png_write_end( &png );
+  return written;
+}
+
+static char *s_default_files[] = { "input/ingo.png", "input/kittens.png", "input/landscape.png" };
+
+static int bench_decode( int num_files, char **files ) {
+  const int reps = 5;
+
+  if ( num_files == 0 ) {
+    num_files = 3;
+    files = s_default_files;
+  }
+
+  printf( "PNG decode, best of %d\n", reps );
+  for ( int f = 0; f < num_files; f++ ) {
+    double best = 0.0;
+    struct Image img;
+    for ( int r = 0; r < reps; r++ ) {
+      double start = now_sec();
+      if ( img_read( files[f], &img ) != IMG_SUCCESS ) {
+        fprintf( stderr, "Error: couldn't read %s\n", files[f] );
+        return 1;
+      }
+      double elapsed = now_sec() - start;
+      if ( r == 0 || elapsed < best )
+        best = elapsed;
+      if ( r < reps - 1 )
+        img_cleanup( &img );
+    }
+    printf( "%-24s %10.3f ms %10.1f Mpixels/s\n", files[f], best * 1e3,
+            (double) img.width * img.height / best / 1e6 );
+    img_cleanup( &img );
+  }
+
+  return 0;
+}
+
+static int bench_encode( int num_files, char **files ) {
+  static const char *profiles[] = { "original", "fast", "balanced", "small", "balanced/mt" };
+  long num_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+  const int reps = 3;
+
+  if ( num_files == 0 ) {
+    num_files = 3;
+    files = s_default_files;
+  }
+
+  printf( "PNG encode, best of %d\n", reps );
+  for ( int f = 0; f < num_files; f++ ) {
+    struct Image img;
+    if ( img_read( files[f], &img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't read %s\n", files[f] );
+      return 1;
+    }
+
+    size_t original_size = 0;
+    for ( int p = 0; p < 5; p++ ) {
+      struct ImageWriteOptions opts = { -1, IMG_STRATEGY_DEFAULT, IMG_FILTER_NONE, 1 };
+      if ( p == 4 ) {
+        img_write_profile( "balanced", &opts );
+        opts.threads = ( num_cpus > 2 ) ? (int) num_cpus : 2;
+      } else if ( p > 0 ) {
+        img_write_profile( profiles[p], &opts );
+      }
+
+      double best = 0.0;
+      size_t size = 0;
+      for ( int r = 0; r < reps; r++ ) {
+        double start = now_sec();
+        size = encode_png( &img, &opts );
+        double elapsed = now_sec() - start;
+        if ( r == 0 || elapsed < best )
+          best = elapsed;
+      }
+      if ( p == 0 )
+        original_size = size;
+      printf( "%-24s %-12s %10.3f ms %10zu bytes %7.1f%%\n", files[f], profiles[p],
+              best * 1e3, size, 100.0 * size / original_size );
+    }
+
+    img_cleanup( &img );
+  }
+
+  return 0;
+}
+
+// A transformation with both a C and an assembly language implementation
+struct SweepCase {
+  const char *name;
+  void (*c_fn)( struct Image *input_img, struct Image *output_img );
+  void (*asm_fn)( struct Image *input_img, struct Image *output_img );
+  int out_scale; // output width and height, relative to the input
+};
+
+static const struct SweepCase s_sweep_cases[] = {
+  { "grayscale", imgproc_grayscale, asm_imgproc_grayscale, 1 },
+  { "fade", fade_rowmajor, fade_asm, 1 },
+  { "rgb", imgproc_rgb, asm_imgproc_rgb, 2 },
+  { NULL, NULL, NULL, 0 },
+};
+
+// Each timed run repeats the transformation until it has processed at
+// least this many pixels, so that small images are timed reliably
+#define SWEEP_MIN_PIXELS ( (size_t) 1 << 24 )
+
+// FNV-1a hash of the pixels of img, to compare outputs
+static uint64_t hash_pixels( const struct Image *img ) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t n = (size_t) img->width * img->height;
+  for ( size_t i = 0; i < n; i++ )
+    hash = ( hash ^ img->data[i] ) * 1099511628211ULL;
+  return hash;
+}
+
+// Time fn on in (one untimed warm-up run, then reps timed runs of
+// iters repetitions each), and print the mean, throughput and spread.
+// Returns the hash of the output.
+static uint64_t sweep_run( const char *name, const char *impl,
+                           void (*fn)( struct Image *, struct Image * ),
+                           struct Image *in, struct Image *out,
+                           int reps, size_t iters, double bytes_per_pixel ) {
+  double sum = 0.0, sum_sq = 0.0;
+  fn( in, out );
+  for ( int r = 0; r < reps; r++ ) {
+    double start = now_sec();
+    for ( size_t k = 0; k < iters; k++ )
+      fn( in, out );
+    double elapsed = ( now_sec() - start ) / iters;
+    sum += elapsed;
+    sum_sq += elapsed * elapsed;
+  }
+
+  double num_pixels = (double) in->width * in->height;
+  double mean = sum / reps;
+  double variance = ( reps > 1 ) ? ( sum_sq - sum * mean ) / ( reps - 1 ) : 0.0;
+  double stddev = ( variance > 0.0 ) ? sqrt( variance ) : 0.0;
+  printf( "%-6d %-10s %-4s %10.3f ns/pixel %8.2f GB/s %6.1f%% stddev", in->width, name, impl,
+          mean * 1e9 / num_pixels, num_pixels * bytes_per_pixel / mean / 1e9, 100.0 * stddev / mean );
+  return hash_pixels( out );
+}
+
+static int bench_sweep( int argc, char **argv ) {
+  int32_t max_size = ( argc > 0 ) ? atoi( argv[0] ) : 16384;
+  int reps = ( argc > 1 ) ? atoi( argv[1] ) : 5;
+  if ( max_size < 64 || reps <= 0 ) {
+    fprintf( stderr, "Usage: imgproc_bench sweep [<max size> [<reps>]]\n" );
+    return 1;
+  }
+
+  double phys_bytes = (double) sysconf( _SC_PHYS_PAGES ) * sysconf( _SC_PAGESIZE );
+  int mismatches = 0;
+
+  printf( "C vs asm, mean of %d runs\n", reps );
+  for ( int32_t size = 64; size <= max_size && size > 0; size *= 2 ) {
+    size_t num_pixels = (size_t) size * size;
+    size_t iters = ( num_pixels < SWEEP_MIN_PIXELS ) ? SWEEP_MIN_PIXELS / num_pixels : 1;
+
+    struct Image input_img;
+    if ( 8.0 * num_pixels > phys_bytes || img_alloc( &input_img, size, size ) != IMG_SUCCESS ) {
+      printf( "%-6d skipped (not enough memory)\n", size );
+      break;
+    }
+    fill_synthetic( &input_img );
+
+    for ( int i = 0; s_sweep_cases[i].name != NULL; i++ ) {
+      const struct SweepCase *c = &s_sweep_cases[i];
+      int scale = c->out_scale;
+      double bytes_per_pixel = 4.0 * ( 1 + scale * scale );
+      struct Image output_img;
+      if ( bytes_per_pixel * num_pixels > 0.75 * phys_bytes ||
+           img_alloc( &output_img, size * scale, size * scale ) != IMG_SUCCESS ) {
+        printf( "%-6d %-10s skipped (not enough memory)\n", size, c->name );
+        continue;
+      }
+
+      uint64_t c_hash = sweep_run( c->name, "c", c->c_fn, &input_img, &output_img,
+                                   reps, iters, bytes_per_pixel );
+      printf( "\n" );
+      uint64_t asm_hash = sweep_run( c->name, "asm", c->asm_fn, &input_img, &output_img,
+                                     reps, iters, bytes_per_pixel );
+      if ( asm_hash != c_hash ) {
+        printf( "  OUTPUT DIFFERS FROM C" );
+        mismatches++;
+      }
+      printf( "\n" );
+      fflush( stdout );
+
+      img_cleanup( &output_img );
+    }
+
+    img_cleanup( &input_img );
+  }
+
+  return ( mismatches > 0 ) ? 1 : 0;
+}
+
+struct BenchCase {
+  const char *name;
+  void (*fn)( struct Image *input_img, struct Image *output_img );
+  int out_scale; // output width and height, relative to the input
+};
+
+static const struct BenchCase s_cases[] = {
+  { "grayscale/colmajor", grayscale_colmajor, 1 },
+  { "grayscale/rowmajor", imgproc_grayscale, 1 },
+  { "grayscale/asm", asm_imgproc_grayscale, 1 },
+  { "fade/colmajor", fade_colmajor, 1 },
+  { "fade/rowmajor", fade_rowmajor, 1 },
+  { "fade/asm", fade_asm, 1 },
+  { "red/colmajor", red_colmajor, 1 },
+  { "red/rowmajor", imgproc_red, 1 },
+  { "rgb/unfused", rgb_unfused, 2 },
+  { "rgb/fused", imgproc_rgb, 2 },
+  { "rgb/asm", asm_imgproc_rgb, 2 },
+  { "kaleido/pixelwise", kaleidoscope_pixelwise, 1 },
+  { "kaleido/blocked", kaleidoscope_blocked, 1 },
+  { "gray+fade/unfused", grayscale_fade_unfused, 1 },
+  { "gray+fade/fused", grayscale_fade_fused, 1 },
+  { NULL, NULL, 0 },
+};
+
+int main( int argc, char **argv ) {
+  if ( argc > 1 && strcmp( argv[1], "encode" ) == 0 )
+    return bench_encode( argc - 2, argv + 2 );
+  if ( argc > 1 && strcmp( argv[1], "decode" ) == 0 )
+    return bench_decode( argc - 2, argv + 2 );
+  if ( argc > 1 && strcmp( argv[1], "sweep" ) == 0 )
+    return bench_sweep( argc - 2, argv + 2 );
+
+  int32_t size = ( argc > 1 ) ? atoi( argv[1] ) : 4096;
+  int reps = ( argc > 2 ) ? atoi( argv[2] ) : 3;
+  if ( size <= 0 || reps <= 0 ) {
+    fprintf( stderr, "Usage: %s [<size> [<reps>]]\n", argv[0] );
+    return 1;
+  }
+
+  struct Image input_img, output_img;
+  if ( img_init( &input_img, size, size ) != IMG_SUCCESS ||
+       img_init( &output_img, size, size ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't allocate %dx%d images\n", size, size );
+    return 1;
+  }
+  fill_synthetic( &input_img );
+
+  double num_pixels = (double) size * size;
+  printf( "%dx%d image, best of %d\n", size, size, reps );
+  for ( int i = 0; s_cases[i].name != NULL; i++ ) {
+    fflush( stdout );
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+      perror( "fork" );
+      return 1;
+    }
+
+    if ( pid == 0 ) {
+      // a larger output is allocated (and its pages touched) once,
+      // outside the timed runs, like the output of the other cases
+      struct Image *out = &output_img, scaled_img;
+      int scale = s_cases[i].out_scale;
+      if ( scale != 1 ) {
+        if ( img_init( &scaled_img, size * scale, size * scale ) != IMG_SUCCESS ) {
+          fprintf( stderr, "Error: couldn't allocate the output image of %s\n", s_cases[i].name );
+          _exit( 1 );
+        }
+        out = &scaled_img;
+      }
+
+      double best = 0.0;
+      for ( int r = 0; r < reps; r++ ) {
+        double start = now_sec();
+        s_cases[i].fn( &input_img, out );
+        double elapsed = now_sec() - start;
+        if ( r == 0 || elapsed < best )
+          best = elapsed;
+      }
+      printf( "%-20s %10.3f ms %10.1f Mpixels/s", s_cases[i].name, best * 1e3, num_pixels / best / 1e6 );
+      fflush( stdout );
+      _exit( 0 );
+    }
+
+    // ru_maxrss of the child (in KiB) includes the input and output
+    // images it inherited, plus whatever the case allocated
+    int status;
+    struct rusage usage;
+    if ( wait4( pid, &status, 0, &usage ) < 0 || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) {
+      fprintf( stderr, "Error: case %s did not complete\n", s_cases[i].name );
+      return 1;
+    }
+    printf( " %10.1f MiB peak RSS\n", usage.ru_maxrss / 1024.0 );
+  }
+
+  img_cleanup( &input_img );
+  img_cleanup( &output_img );
+  return 0;
+}
@@ -0,0 +1,27 @@
+// Parts of the image processing API shared by the C and assembly
+// language implementations of the transformations
+
+#include <string.h>
+#include "imgproc.h"
+
+int imgproc_output_size( const char *transformation, const struct Image *input_img,
+                         int32_t *output_width, int32_t *output_height ) {
+  if ( strcmp( transformation, "rgb" ) == 0 ) {
+    // four quadrants, each the size of the input image
+    if ( input_img->width > INT32_MAX / 2 || input_img->height > INT32_MAX / 2 )
+      return 0;
+    *output_width = 2 * input_img->width;
+    *output_height = 2 * input_img->height;
+    return 1;
+  }
+
+  if ( strcmp( transformation, "grayscale" ) == 0 ||
+       strcmp( transformation, "fade" ) == 0 ||
+       strcmp( transformation, "kaleidoscope" ) == 0 ) {
+    *output_width = input_img->width;
+    *output_height = input_img->height;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,166 @@
+// Row-major pixel iteration layer shared by the image transformations
+//
+// When more than one thread is configured, the rows are split into bands
+// which are claimed dynamically by a persistent pool of worker threads
+// (plus the calling thread). Every row is produced by exactly one kernel
+// invocation, so the output does not depend on the number of threads.
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "imgproc_rows.h"
+
+// A single invocation of imgproc_for_each_row shared with the workers
+struct RowJob {
+  struct Image *input_img;
+  struct Image *output_img;
+  int32_t num_rows;
+  int32_t band_rows;
+  imgproc_row_fn kernel;
+  void *arg;
+  int32_t next_row; // first row of the next unclaimed band (atomic)
+};
+
+// Set under s_dispatch_lock, but read without it (atomically)
+static int s_num_threads = 1;
+
+// Worker pool state, protected by s_pool_lock
+static pthread_mutex_t s_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *s_workers;
+static int s_num_workers;
+static struct RowJob *s_job;
+static unsigned s_job_seq;
+static int s_num_busy;
+static int s_shutdown;
+
+// Serializes callers, since the pool runs one job at a time
+static pthread_mutex_t s_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Claim and process bands of rows until the job has none left
+static void run_bands( struct RowJob *job ) {
+  for ( ;; ) {
+    int32_t start = __atomic_fetch_add( &job->next_row, job->band_rows, __ATOMIC_RELAXED );
+    if ( start >= job->num_rows )
+      break;
+    int32_t end = ( job->num_rows - start < job->band_rows ) ? job->num_rows : start + job->band_rows;
+    for ( int32_t row = start; row < end; row++ )
+      job->kernel( job->input_img, job->output_img, row, job->arg );
+  }
+}
+
+static void *worker_main( void *unused ) {
+  (void) unused;
+  unsigned seen_seq = 0;
+
+  pthread_mutex_lock( &s_pool_lock );
+  for ( ;; ) {
+    while ( !s_shutdown && s_job_seq == seen_seq )
+      pthread_cond_wait( &s_work_cond, &s_pool_lock );
+    if ( s_shutdown )
+      break;
+
+    seen_seq = s_job_seq;
+    struct RowJob *job = s_job;
+    pthread_mutex_unlock( &s_pool_lock );
+
+    run_bands( job );
+
+    pthread_mutex_lock( &s_pool_lock );
+    if ( --s_num_busy == 0 )
+      pthread_cond_signal( &s_done_cond );
+  }
+  pthread_mutex_unlock( &s_pool_lock );
+  return NULL;
+}
+
+// Stop and join all worker threads
+static void stop_workers( void ) {
+  pthread_mutex_lock( &s_pool_lock );
+  s_shutdown = 1;
+  pthread_cond_broadcast( &s_work_cond );
+  pthread_mutex_unlock( &s_pool_lock );
+
+  for ( int i = 0; i < s_num_workers; i++ )
+    pthread_join( s_workers[i], NULL );
+
+  free( s_workers );
+  s_workers = NULL;
+  s_num_workers = 0;
+  s_job_seq = 0;
+  s_shutdown = 0;
+}
+
+// Start the worker threads (the calling thread is the remaining one).
+// Returns the number of workers actually started.
+static int start_workers( void ) {
+  int wanted = s_num_threads - 1;
+  s_workers = (pthread_t *) malloc( wanted * sizeof( pthread_t ) );
+  if ( s_workers == NULL )
+    return 0;
+
+  while ( s_num_workers < wanted &&
+          pthread_create( &s_workers[s_num_workers], NULL, worker_main, NULL ) == 0 )
+    s_num_workers++;
+
+  if ( s_num_workers == 0 ) {
+    free( s_workers );
+    s_workers = NULL;
+  }
+  return s_num_workers;
+}
+
+void imgproc_set_num_threads( int num_threads ) {
+  if ( num_threads <= 0 ) {
+    long online = sysconf( _SC_NPROCESSORS_ONLN );
+    num_threads = ( online > 0 ) ? (int) online : 1;
+  }
+
+  pthread_mutex_lock( &s_dispatch_lock );
+  if ( s_num_workers > 0 )
+    stop_workers();
+  __atomic_store_n( &s_num_threads, num_threads, __ATOMIC_RELAXED );
+  pthread_mutex_unlock( &s_dispatch_lock );
+}
+
+int imgproc_get_num_threads( void ) {
+  return __atomic_load_n( &s_num_threads, __ATOMIC_RELAXED );
+}
+
+void imgproc_for_each_row( struct Image *input_img, struct Image *output_img,
+                           int32_t num_rows, imgproc_row_fn kernel, void *arg ) {
+  // Run serially if single-threaded, if there is too little work to
+  // share, or if another caller (or an enclosing call) holds the pool
+  if ( imgproc_get_num_threads() <= 1 || num_rows < 2 || pthread_mutex_trylock( &s_dispatch_lock ) != 0 ) {
+    for ( int32_t row = 0; row < num_rows; row++ )
+      kernel( input_img, output_img, row, arg );
+    return;
+  }
+
+  if ( s_num_workers == 0 )
+    start_workers();
+
+  // Several bands per thread, so that uneven rows still balance
+  int32_t band_rows = num_rows / ( ( s_num_workers + 1 ) * 4 );
+  struct RowJob job = {
+    input_img, output_img, num_rows, ( band_rows > 0 ) ? band_rows : 1, kernel, arg, 0
+  };
+
+  pthread_mutex_lock( &s_pool_lock );
+  s_job = &job;
+  s_job_seq++;
+  s_num_busy = s_num_workers;
+  pthread_cond_broadcast( &s_work_cond );
+  pthread_mutex_unlock( &s_pool_lock );
+
+  run_bands( &job );
+
+  pthread_mutex_lock( &s_pool_lock );
+  while ( s_num_busy > 0 )
+    pthread_cond_wait( &s_done_cond, &s_pool_lock );
+  s_job = NULL;
+  pthread_mutex_unlock( &s_pool_lock );
+
+  pthread_mutex_unlock( &s_dispatch_lock );
+}
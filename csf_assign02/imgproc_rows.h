@@ -0,0 +1,66 @@
+// Row-major pixel iteration layer shared by the image transformations.
+//
+// Every transformation is expressed as a "row kernel" that produces
+// one row of output from the input image. Each kernel touches memory
+// strictly sequentially within a row (data[row * width + 0 .. width - 1]).
+// Rows must be independent of each other: with more than one thread,
+// bands of rows are processed concurrently and in no particular order.
+
+#ifndef IMGPROC_ROWS_H
+#define IMGPROC_ROWS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// Row kernel callback.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   output_img - pointer to the output Image
+//   row        - index of the row to process
+//   arg        - transformation-specific context (may be NULL)
+typedef void (*imgproc_row_fn)( struct Image *input_img, struct Image *output_img,
+                                int32_t row, void *arg );
+
+// Set the number of threads used by imgproc_for_each_row. A value of 1
+// (the default) processes rows on the calling thread only; a value of 0
+// or less uses one thread per online CPU.
+void imgproc_set_num_threads( int num_threads );
+
+// Return the number of threads used by imgproc_for_each_row.
+int imgproc_get_num_threads( void );
+
+// Invoke kernel exactly once for each row in [0, num_rows), and return
+// when all rows are done.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   output_img - pointer to the output Image
+//   num_rows   - number of rows to process
+//   kernel     - the row kernel
+//   arg        - context passed through to the kernel
+void imgproc_for_each_row( struct Image *input_img, struct Image *output_img,
+                           int32_t num_rows, imgproc_row_fn kernel, void *arg );
+
+// Return a pointer to the first pixel of the given row of img.
+static inline uint32_t *imgproc_row_ptr( struct Image *img, int32_t row ) {
+  return img->data + (size_t) row * (size_t) img->width;
+}
+
+// Define a row kernel named "name" which applies the per-pixel function
+// (or macro) "pixel_fn" to every pixel of an input row, storing the
+// results in the same row of the output image. Both images must
+// have the same width.
+#define IMGPROC_POINTWISE_ROW_FN( name, pixel_fn ) \
+  static void name( struct Image *input_img, struct Image *output_img, \
+                    int32_t row, void *arg ) { \
+    (void) arg; \
+    const uint32_t *in = imgproc_row_ptr( input_img, row ); \
+    uint32_t *out = imgproc_row_ptr( output_img, row ); \
+    int32_t width = input_img->width; \
+    for ( int32_t j = 0; j < width; j++ ) \
+      out[j] = pixel_fn( in[j] ); \
+  }
+
+#endif // IMGPROC_ROWS_H
@@ -1,8 +1,15 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
 #include "tctest.h"
 #include "imgproc.h"
+#include "imgproc_rows.h"
+#include "pnglite.h"
 
 // An expected color identified by a (non-zero) character code.
 // Used in the "struct Picture" data type.
@@ -93,6 +100,11 @@ typedef struct {
   // empty image for output of kaleidoscope transformation
   struct Image *sq_test_out;
 
+  // private temporary directory and the file in it used by a test
+  // (see temp_filename()), removed by cleanup() however the test ends
+  char tmp_dir[PATH_MAX];
+  char tmp_file[PATH_MAX];
+
 } TestObjs;
 
 // Functions to create and clean up a test fixture object
@@ -104,6 +116,7 @@ struct Image *picture_to_img( const struct Picture *pic );
 uint32_t lookup_color(char c, const struct ExpectedColor *colors);
 bool images_equal( struct Image *a, struct Image *b );
 void destroy_img( struct Image *img );
+const char *temp_filename( TestObjs *objs, const char *name );
 
 // Test functions
 void test_rgb_basic( TestObjs *objs );
@@ -124,6 +137,21 @@ void test_kaleidoscope_dense(TestObjs *objs);
 void test_kaleidoscope_diagonal(TestObjs *objs);
 void test_kaleidoscope_center(TestObjs *objs);
 
+void test_grayscale_all_widths(TestObjs *objs);
+void test_threads_deterministic(TestObjs *objs);
+void test_img_init_alloc(TestObjs *objs);
+void test_img_reader_rows(TestObjs *objs);
+void test_img_write_roundtrip(TestObjs *objs);
+void test_png_filter_types(TestObjs *objs);
+void test_png_unfilter_kernels(TestObjs *objs);
+void test_img_mem_roundtrip(TestObjs *objs);
+void test_img_write_reused_streams(TestObjs *objs);
+void test_img_stats(TestObjs *objs);
+void test_img_size_limits(TestObjs *objs);
+void test_img_larger_than_4gib(TestObjs *objs);
+void test_fused_pointwise(TestObjs *objs);
+void test_kaleidoscope_sizes(TestObjs *objs);
+
 
 int main( int argc, char **argv ) {
   // allow the specific test to execute to be specified as the
@@ -138,6 +166,22 @@ int main( int argc, char **argv ) {
   // for any additional test functions you add.
   TEST( test_rgb_basic );
   TEST( test_grayscale_basic );
+  TEST( test_grayscale_all_widths );
+  TEST( test_threads_deterministic );
+  TEST( test_img_init_alloc );
+  TEST( test_img_reader_rows );
+  TEST( test_img_write_roundtrip );
+  TEST( test_png_filter_types );
+  TEST( test_png_unfilter_kernels );
+  TEST( test_img_mem_roundtrip );
+  TEST( test_img_write_reused_streams );
+  TEST( test_img_stats );
+  TEST( test_img_size_limits );
+  TEST( test_img_larger_than_4gib );
+  TEST( test_fused_pointwise );
+#ifndef IMGPROC_ASM_TESTS
+  TEST( test_kaleidoscope_sizes ); // the assembly kaleidoscope is not implemented
+#endif
   //TEST( test_fade_basic );
   //TEST( test_kaleidoscope_basic );
 
@@ -208,6 +252,9 @@ TestObjs *setup( void ) {
   objs->sq_test_out = (struct Image *) malloc( sizeof( struct Image ) );
   img_init( objs->sq_test_out, objs->sq_test->width, objs->sq_test->height );
 
+  objs->tmp_dir[0] = '\0';
+  objs->tmp_file[0] = '\0';
+
   return objs;
 }
 
@@ -218,6 +265,11 @@ void cleanup( TestObjs *objs ) {
   destroy_img( objs->sq_test );
   destroy_img( objs->sq_test_out );
 
+  if ( objs->tmp_dir[0] != '\0' ) {
+    remove( objs->tmp_file );
+    rmdir( objs->tmp_dir );
+  }
+
   free( objs );
 }
 
@@ -272,6 +324,29 @@ void destroy_img( struct Image *img ) {
   free( img );
 }
 
+// Returns the path of a file called name in a new private directory
+// under $TMPDIR (or /tmp). cleanup() removes the file and the directory,
+// also if the test fails. Can be called once per test.
+const char *temp_filename( TestObjs *objs, const char *name ) {
+  const char *tmp = getenv( "TMPDIR" );
+  if ( tmp == NULL || tmp[0] == '\0' )
+    tmp = "/tmp";
+
+  int len = snprintf( objs->tmp_dir, sizeof( objs->tmp_dir ), "%s/imgproc_tests.XXXXXX", tmp );
+  if ( len < 0 || len + 1 + strlen( name ) >= sizeof( objs->tmp_file ) ) {
+    objs->tmp_dir[0] = '\0';
+    FAIL( "temporary file name too long" );
+  }
+  if ( mkdtemp( objs->tmp_dir ) == NULL ) {
+    objs->tmp_dir[0] = '\0';
+    FAIL( "couldn't create a temporary directory" );
+  }
+  memcpy( objs->tmp_file, objs->tmp_dir, len );
+  objs->tmp_file[len] = '/';
+  strcpy( objs->tmp_file + len + 1, name );
+  return objs->tmp_file;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Test functions
 ////////////////////////////////////////////////////////////////////////
@@ -658,4 +733,532 @@ void test_helper_functions(TestObjs *objs) {
   test_img.width = 10;
   test_img.height = 10;
   ASSERT(compute_index(&test_img, 5, 6) == 65); // 6 * 10 + 5 = 65
-}
\ No newline at end of file
+}
+
+void test_grayscale_all_widths(TestObjs *objs) {
+  // Vectorized grayscale must match to_grayscale() exactly, for every
+  // width (full vectors plus a scalar tail) and every channel value
+  uint32_t state = 12345;
+  for (int width = 1; width <= 40; width++) {
+    struct Image in, out;
+    img_init(&in, width, 3);
+    img_init(&out, width, 3);
+    for (int i = 0; i < width * 3; i++) {
+      state = state * 1664525U + 1013904223U;
+      in.data[i] = state;
+    }
+    in.data[0] = 0xFFFFFFFF; // brightest possible pixel
+
+    imgproc_grayscale(&in, &out);
+
+    for (int i = 0; i < width * 3; i++) {
+      ASSERT(out.data[i] == to_grayscale(in.data[i]));
+    }
+
+    img_cleanup(&in);
+    img_cleanup(&out);
+  }
+}
+
+// The transformations with a uniform signature, for table-driven tests.
+// Each returns 1 if the transformation succeeded.
+static int grayscale_xform(struct Image *in, struct Image *out) {
+  imgproc_grayscale(in, out);
+  return 1;
+}
+
+static int rgb_xform(struct Image *in, struct Image *out) {
+  imgproc_rgb(in, out);
+  return 1;
+}
+
+static int fade_xform(struct Image *in, struct Image *out) {
+  return imgproc_fade(in, out);
+}
+
+#ifndef IMGPROC_ASM_TESTS
+static int kaleidoscope_xform(struct Image *in, struct Image *out) {
+  return imgproc_kaleidoscope(in, out);
+}
+#endif
+
+void test_threads_deterministic(TestObjs *objs) {
+  // Every transformation must produce identical output regardless of
+  // how many threads process its rows
+  static const struct {
+    int (*fn)(struct Image *, struct Image *);
+    int scale; // output width and height, relative to the input
+  } xforms[] = {
+    { grayscale_xform, 1 },
+    { rgb_xform, 2 },
+    { fade_xform, 1 },
+#ifndef IMGPROC_ASM_TESTS
+    { kaleidoscope_xform, 1 }, // not implemented in assembly language
+#endif
+  };
+  const int num_xforms = sizeof(xforms) / sizeof(xforms[0]);
+
+  struct Image in;
+  img_init(&in, 61, 61);
+  uint32_t state = 777;
+  for (int i = 0; i < 61 * 61; i++) {
+    state = state * 1664525U + 1013904223U;
+    in.data[i] = state;
+  }
+
+  for (int x = 0; x < num_xforms; x++) {
+    struct Image single, multi;
+    int32_t size = 61 * xforms[x].scale;
+    img_init(&single, size, size);
+    img_init(&multi, size, size);
+
+    imgproc_set_num_threads(1);
+    ASSERT(xforms[x].fn(&in, &single));
+    imgproc_set_num_threads(5);
+    ASSERT(xforms[x].fn(&in, &multi));
+    imgproc_set_num_threads(1);
+
+    ASSERT(images_equal(&single, &multi));
+
+    img_cleanup(&single);
+    img_cleanup(&multi);
+  }
+
+  img_cleanup(&in);
+}
+
+void test_img_init_alloc(TestObjs *objs) {
+  // sizes below, at, and well above the fill block size
+  int32_t sizes[][2] = { { 1, 1 }, { 7, 3 }, { 64, 64 }, { 4097, 3 } };
+
+  for (int i = 0; i < 4; i++) {
+    struct Image img, uninit;
+    ASSERT(img_init(&img, sizes[i][0], sizes[i][1]) == IMG_SUCCESS);
+    ASSERT(img_alloc(&uninit, sizes[i][0], sizes[i][1]) == IMG_SUCCESS);
+
+    ASSERT(((uintptr_t) img.data) % IMG_ALIGNMENT == 0);
+    ASSERT(((uintptr_t) uninit.data) % IMG_ALIGNMENT == 0);
+    ASSERT(uninit.width == sizes[i][0] && uninit.height == sizes[i][1]);
+
+    // img_init fills every pixel with opaque black
+    for (int32_t j = 0; j < sizes[i][0] * sizes[i][1]; j++) {
+      ASSERT(img.data[j] == 0x000000FFU);
+    }
+
+    img_cleanup(&img);
+    img_cleanup(&uninit);
+  }
+}
+
+void test_img_reader_rows(TestObjs *objs) {
+  // Reading an image one row at a time must produce the same pixels
+  // as img_read (kittens.png is RGB, ingo.png is RGBA)
+  const char *files[] = { "input/kittens.png", "input/ingo.png" };
+
+  for (int i = 0; i < 2; i++) {
+    struct Image whole;
+    struct ImageReader reader;
+    ASSERT(img_read(files[i], &whole) == IMG_SUCCESS);
+    ASSERT(img_reader_open(&reader, files[i]) == IMG_SUCCESS);
+    ASSERT(reader.width == whole.width && reader.height == whole.height);
+
+    uint32_t *row = malloc(reader.width * sizeof(uint32_t));
+    for (int32_t y = 0; y < reader.height; y++) {
+      ASSERT(img_reader_read_row(&reader, row) == IMG_SUCCESS);
+      ASSERT(memcmp(row, whole.data + (size_t) y * whole.width,
+                    whole.width * sizeof(uint32_t)) == 0);
+    }
+
+    free(row);
+    img_reader_close(&reader);
+    img_cleanup(&whole);
+  }
+}
+
+void test_img_write_roundtrip(TestObjs *objs) {
+  // Writing and reading back must preserve every pixel, whichever
+  // filter types the writer picks (smooth gradients favour the
+  // predicting filters, noise favours no filtering), and whether or
+  // not the image data is compressed in parallel blocks (400x300
+  // makes several batches of blocks with 3 threads)
+  int32_t sizes[][2] = { { 1, 1 }, { 3, 5 }, { 37, 29 }, { 300, 40 }, { 400, 300 } };
+  const char *filename = temp_filename(objs, "roundtrip.png");
+  struct ImageWriteOptions opts;
+  img_write_profile("balanced", &opts);
+
+  uint32_t state = 4242;
+  for (int i = 0; i < 5; i++) {
+    struct Image img, readback;
+    img_init(&img, sizes[i][0], sizes[i][1]);
+    for (int32_t y = 0; y < img.height; y++) {
+      for (int32_t x = 0; x < img.width; x++) {
+        state = state * 1664525U + 1013904223U;
+        uint32_t gradient = ((x & 0xFFU) << 24) | ((y & 0xFFU) << 16) | (((x + y) & 0xFFU) << 8) | 0xFFU;
+        img.data[y * img.width + x] = (x < img.width / 2) ? gradient : state;
+      }
+    }
+
+    for (opts.threads = 1; opts.threads <= 3; opts.threads += 2) {
+      ASSERT(img_write_with_options(filename, &img, &opts) == IMG_SUCCESS);
+      ASSERT(img_read(filename, &readback) == IMG_SUCCESS);
+      ASSERT(images_equal(&img, &readback));
+      img_cleanup(&readback);
+    }
+
+    img_cleanup(&img);
+  }
+
+}
+
+void test_png_filter_types(TestObjs *objs) {
+  // Every filter type must decode back to the original pixels, for
+  // widths with and without a partial vector at the end of the row
+  const char *filename = temp_filename(objs, "filters.png");
+  struct ImageWriteOptions opts;
+  img_write_profile("balanced", &opts);
+
+  uint32_t state = 99;
+  for (int32_t width = 1; width <= 9; width += 4) {
+    struct Image img, readback;
+    img_init(&img, width, 7);
+    for (int32_t i = 0; i < width * 7; i++) {
+      state = state * 1664525U + 1013904223U;
+      img.data[i] = state;
+    }
+
+    for (opts.filter = IMG_FILTER_NONE; opts.filter <= IMG_FILTER_PAETH; opts.filter++) {
+      ASSERT(img_write_with_options(filename, &img, &opts) == IMG_SUCCESS);
+      ASSERT(img_read(filename, &readback) == IMG_SUCCESS);
+      ASSERT(images_equal(&img, &readback));
+      img_cleanup(&readback);
+    }
+
+    img_cleanup(&img);
+  }
+
+}
+
+void test_png_unfilter_kernels(TestObjs *objs) {
+  // The unfilter kernels png_read_row uses for 3 and 4 bytes per pixel
+  // must give exactly the bytes of the reference functions, for every
+  // filter type and for rows with and without a partial 16-byte vector
+  // at the end, and must not write past the end of the row
+  static const unsigned widths[] = { 1, 2, 5, 6, 16, 21, 37, 64 };
+  unsigned char in[64 * 4], prev[64 * 4], expected[64 * 4], actual[64 * 4 + 16];
+  uint32_t state = 31337;
+
+  for (int bpp = 3; bpp <= 4; bpp++) {
+    for (int w = 0; w < 8; w++) {
+      unsigned len = widths[w] * bpp;
+      for (int filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+        for (int rep = 0; rep < 20; rep++) {
+          for (unsigned i = 0; i < len; i++) {
+            state = state * 1664525U + 1013904223U;
+            in[i] = state >> 24;
+            prev[i] = state >> 16;
+          }
+          memset(actual, 0xA5, sizeof(actual));
+
+          ASSERT(png_unfilter(filter, bpp, in, expected, prev, len, 1) == PNG_NO_ERROR);
+          ASSERT(png_unfilter(filter, bpp, in, actual, prev, len, 0) == PNG_NO_ERROR);
+          ASSERT(memcmp(expected, actual, len) == 0);
+          for (unsigned i = len; i < sizeof(actual); i++) {
+            ASSERT(actual[i] == 0xA5);
+          }
+        }
+      }
+    }
+  }
+}
+
+void test_img_mem_roundtrip(TestObjs *objs) {
+  // Encoding to memory must produce exactly the bytes img_write puts
+  // in a file (large enough for the output buffer to grow), and
+  // decoding them from memory must give back the original pixels
+  const char *filename = temp_filename(objs, "mem.png");
+  struct Image img, readback;
+  img_init(&img, 300, 200);
+  uint32_t state = 7;
+  for (int32_t i = 0; i < 300 * 200; i++) {
+    state = state * 1664525U + 1013904223U;
+    img.data[i] = state;
+  }
+
+  void *buf;
+  size_t len;
+  ASSERT(img_write_mem(&img, &buf, &len) == IMG_SUCCESS);
+  ASSERT(img_write(filename, &img) == IMG_SUCCESS);
+
+  FILE *in = fopen(filename, "rb");
+  ASSERT(in != NULL);
+  unsigned char *file_data = malloc(len + 1);
+  size_t file_len = fread(file_data, 1, len + 1, in);
+  fclose(in);
+  ASSERT(file_len == len);
+  ASSERT(memcmp(file_data, buf, len) == 0);
+  free(file_data);
+
+  ASSERT(img_read_mem(buf, len, &readback) == IMG_SUCCESS);
+  ASSERT(images_equal(&img, &readback));
+  img_cleanup(&readback);
+
+  // truncated data must be rejected
+  ASSERT(img_read_mem(buf, 20, &readback) != IMG_SUCCESS);
+  ASSERT(img_read_mem(buf, len / 2, &readback) != IMG_SUCCESS);
+
+  free(buf);
+  img_cleanup(&img);
+}
+
+void test_img_write_reused_streams(TestObjs *objs) {
+  // The zlib streams kept between images must not change the output,
+  // also when consecutive images use different compression settings
+  const char *filename = temp_filename(objs, "streams.png");
+  struct ImageWriteOptions fast, small;
+  img_write_profile("fast", &fast);
+  img_write_profile("small", &small);
+
+  struct Image img, readback;
+  img_init(&img, 64, 48);
+  for (int32_t i = 0; i < 64 * 48; i++) {
+    img.data[i] = (uint32_t) i * 2654435761U;
+  }
+
+  void *first, *again;
+  size_t first_len, again_len;
+  ASSERT(img_write_mem(&img, &first, &first_len) == IMG_SUCCESS);
+  for (int i = 0; i < 2; i++) {
+    ASSERT(img_write_with_options(filename, &img, (i == 0) ? &fast : &small) == IMG_SUCCESS);
+    ASSERT(img_read(filename, &readback) == IMG_SUCCESS);
+    ASSERT(images_equal(&img, &readback));
+    img_cleanup(&readback);
+  }
+  ASSERT(img_write_mem(&img, &again, &again_len) == IMG_SUCCESS);
+  ASSERT(again_len == first_len);
+  ASSERT(memcmp(first, again, first_len) == 0);
+
+  free(first);
+  free(again);
+  img_cleanup(&img);
+}
+
+void test_img_stats(TestObjs *objs) {
+  // The statistics must count every pixel and byte of the images read
+  // and written while they are collected, and nothing after that
+  struct Image img, readback;
+  img_init(&img, 50, 40);
+  for (int32_t i = 0; i < 50 * 40; i++) {
+    img.data[i] = (uint32_t) i * 2654435761U;
+  }
+
+  struct ImageStats stats;
+  memset(&stats, 0, sizeof(stats));
+  img_set_stats(&stats);
+
+  void *buf;
+  size_t len;
+  ASSERT(img_write_mem(&img, &buf, &len) == IMG_SUCCESS);
+  ASSERT(stats.bytes_written == len);
+  ASSERT(stats.pixels_written == 50 * 40);
+  ASSERT(stats.deflate_time > 0.0);
+
+  ASSERT(img_read_mem(buf, len, &readback) == IMG_SUCCESS);
+  ASSERT(stats.pixels_read == 50 * 40);
+  ASSERT(stats.bytes_read > 0 && stats.bytes_read <= len);
+  ASSERT(stats.inflate_time > 0.0);
+  img_cleanup(&readback);
+
+  img_set_stats(NULL);
+  ASSERT(img_read_mem(buf, len, &readback) == IMG_SUCCESS);
+  ASSERT(stats.pixels_read == 50 * 40);
+  img_cleanup(&readback);
+
+  free(buf);
+  img_cleanup(&img);
+}
+
+void test_img_size_limits(TestObjs *objs) {
+  // Sizes which can't be represented must be rejected rather than
+  // wrapped around
+  struct Image img;
+  ASSERT(img_alloc(&img, -1, 10) == IMG_ERR_TOO_LARGE);
+  ASSERT(img_init(&img, 10, -1) == IMG_ERR_TOO_LARGE);
+
+  int32_t out_w, out_h;
+  img.width = 0x40000000;
+  img.height = 2;
+  ASSERT(!imgproc_output_size("rgb", &img, &out_w, &out_h));
+  ASSERT(imgproc_output_size("grayscale", &img, &out_w, &out_h));
+
+  // a 4 GiB row does not fit in the byte counts of a scanline, and
+  // rejecting it must not create the output file
+  const char *filename = temp_filename(objs, "limits.png");
+  struct ImageWriter writer;
+  ASSERT(img_writer_open(&writer, filename, 0x40000000, 1, NULL) == IMG_ERR_TOO_LARGE);
+  ASSERT(img_writer_open(&writer, filename, -5, 1, NULL) == IMG_ERR_TOO_LARGE);
+  ASSERT(access(filename, F_OK) != 0);
+
+  // nor can a png with a width above 2^31 - 1 be read
+  img_init(&img, 2, 2);
+  void *buf;
+  size_t len;
+  ASSERT(img_write_mem(&img, &buf, &len) == IMG_SUCCESS);
+  unsigned char *ihdr = (unsigned char *) buf + 12;  // after the signature and chunk length
+  ihdr[4] = 0x80;
+  uint32_t crc = crc32(0L, ihdr, 17);
+  ihdr[17] = crc >> 24;
+  ihdr[18] = crc >> 16;
+  ihdr[19] = crc >> 8;
+  ihdr[20] = crc;
+  struct Image readback;
+  ASSERT(img_read_mem(buf, len, &readback) != IMG_SUCCESS);
+
+  free(buf);
+  img_cleanup(&img);
+}
+
+void test_img_larger_than_4gib(TestObjs *objs) {
+  // An image with more than 4 GiB of pixel data must be written and
+  // read back intact: the last row starts exactly 4 GiB into the
+  // pixels, where a 32-bit offset would wrap around to the first row.
+  // The pixels are in untouched anonymous memory (which reads as
+  // zeros without using any), apart from a few marked ones.
+  const char *filename = temp_filename(objs, "4gib.png");
+  const int32_t width = 65536, height = 16385;
+  const size_t num_pixels = (size_t) width * height;
+  struct Image img = { width, height, NULL };
+  img.data = mmap(NULL, num_pixels * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  ASSERT(img.data != MAP_FAILED);
+
+  const size_t last_row = (size_t) (height - 1) * width;
+  img.data[0] = 0x11223344U;
+  img.data[last_row] = 0x55667788U;
+  img.data[num_pixels - 1] = 0x99AABBCCU;
+
+  struct ImageWriteOptions opts;
+  img_write_profile("fast", &opts);
+  opts.filter = IMG_FILTER_NONE;
+  ASSERT(img_write_with_options(filename, &img, &opts) == IMG_SUCCESS);
+
+  // read it back one row at a time
+  struct ImageReader reader;
+  uint32_t *row = malloc(width * sizeof(uint32_t));
+  ASSERT(img_reader_open(&reader, filename) == IMG_SUCCESS);
+  ASSERT(reader.width == width && reader.height == height);
+  for (int32_t i = 0; i < height; i++) {
+    ASSERT(img_reader_read_row(&reader, row) == IMG_SUCCESS);
+    ASSERT(memcmp(row, img.data + (size_t) i * width, width * sizeof(uint32_t)) == 0);
+  }
+  img_reader_close(&reader);
+  free(row);
+
+  // and as a whole, if there is enough memory for it
+  double phys_bytes = (double) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  if (phys_bytes > 1.25 * num_pixels * sizeof(uint32_t)) {
+    struct Image readback;
+    ASSERT(img_read(filename, &readback) == IMG_SUCCESS);
+    ASSERT(readback.data[0] == 0x11223344U);
+    ASSERT(readback.data[1] == 0);
+    ASSERT(readback.data[last_row] == 0x55667788U);
+    ASSERT(readback.data[num_pixels - 1] == 0x99AABBCCU);
+    img_cleanup(&readback);
+  }
+
+  munmap(img.data, num_pixels * sizeof(uint32_t));
+}
+
+void test_fused_pointwise(TestObjs *objs) {
+  // A fused sequence of pointwise transformations must give the same
+  // pixels as applying them one after another
+  static const char *const sequences[][4] = {
+    { "grayscale", "fade", NULL, NULL },
+    { "fade", "grayscale", "red", NULL },
+    { "blue", "fade", "fade", "green" },
+    { "fade", NULL, NULL, NULL },
+  };
+  struct Image img, fused, expected, tmp;
+  img_init(&img, 37, 29);
+  img_init(&fused, 37, 29);
+  img_init(&expected, 37, 29);
+  img_init(&tmp, 37, 29);
+
+  uint32_t state = 1234;
+  for (int32_t i = 0; i < 37 * 29; i++) {
+    state = state * 1664525U + 1013904223U;
+    img.data[i] = state;
+  }
+
+  int supported = 0;
+  for (int s = 0; s < 4; s++) {
+    int count = 0;
+    memcpy(expected.data, img.data, 37 * 29 * sizeof(uint32_t));
+    while (count < 4 && sequences[s][count] != NULL) {
+      const char *name = sequences[s][count++];
+      memcpy(tmp.data, expected.data, 37 * 29 * sizeof(uint32_t));
+      if (strcmp(name, "grayscale") == 0) {
+        imgproc_grayscale(&tmp, &expected);
+      } else if (strcmp(name, "fade") == 0) {
+        ASSERT(imgproc_fade(&tmp, &expected) == 1);
+      } else {
+        uint32_t mask = (strcmp(name, "red") == 0) ? 0xFF0000FFU
+                      : (strcmp(name, "green") == 0) ? 0x00FF00FFU : 0x0000FFFFU;
+        for (int32_t i = 0; i < 37 * 29; i++) {
+          expected.data[i] = tmp.data[i] & mask;
+        }
+      }
+    }
+
+    // an implementation which does not fuse (the assembly one) returns 0
+    // for every sequence, and its callers apply the steps one by one
+    int fused_ok = imgproc_fused_pointwise(&img, &fused, sequences[s], count);
+    if (s == 0) {
+      supported = fused_ok;
+    }
+    ASSERT(fused_ok == supported);
+    if (fused_ok) {
+      ASSERT(images_equal(&fused, &expected));
+    }
+  }
+
+  // only pointwise transformations can be fused
+  const char *not_pointwise[] = { "grayscale", "kaleidoscope" };
+  ASSERT(!imgproc_fused_pointwise(&img, &fused, not_pointwise, 2));
+
+  img_cleanup(&img);
+  img_cleanup(&fused);
+  img_cleanup(&expected);
+  img_cleanup(&tmp);
+}
+
+void test_kaleidoscope_sizes(TestObjs *objs) {
+  // Output pixel (row, col) is the input pixel at (min, max) of the row
+  // and column folded into the top-left quadrant, whose side is
+  // ceil(size / 2), for even and odd sizes, and sizes spanning several
+  // tiles of the blocked transpose
+  for (int32_t size = 1; size <= 75; size++) {
+    struct Image img, out;
+    img_init(&img, size, size);
+    img_init(&out, size, size);
+    uint32_t state = size;
+    for (int32_t i = 0; i < size * size; i++) {
+      state = state * 1664525U + 1013904223U;
+      img.data[i] = state;
+    }
+
+    ASSERT(imgproc_kaleidoscope(&img, &out));
+
+    int32_t half = (size + 1) / 2;
+    for (int32_t row = 0; row < size; row++) {
+      for (int32_t col = 0; col < size; col++) {
+        int32_t a = (row < half) ? row : size - 1 - row;
+        int32_t b = (col < half) ? col : size - 1 - col;
+        int32_t src = (a < b) ? a * size + b : b * size + a;
+        ASSERT(out.data[row * size + col] == img.data[src]);
+      }
+    }
+
+    img_cleanup(&img);
+    img_cleanup(&out);
+  }
+}
@@ -12,16 +12,96 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pnglite.h"
 
+/* number of bytes of compressed data read from the file at a time */
+#define PNG_READ_CHUNK_SIZE	65536
+
+/* maximum number of bytes of compressed data in each IDAT chunk written */
+#define PNG_WRITE_CHUNK_SIZE	65536
+
+/* number of bytes of filtered scanlines in each independently compressed block of the parallel encoder, and
+   the number of preceding bytes each block uses as its dictionary (the size of the deflate window) */
+#define PNG_BLOCK_SIZE		131072
+#define PNG_DICT_SIZE		32768
+
+/* largest width or height allowed by the png specification */
+#define PNG_MAX_DIMENSION	0x7FFFFFFFU
+
+/* One block of the parallel encoder */
+typedef struct
+{
+	const unsigned char*		in;				/* filtered scanline bytes to compress */
+	unsigned			in_len;
+	unsigned			dict_len;			/* number of bytes before in used as the dictionary */
+	int				last;				/* whether this block ends the deflate stream */
+	int				level;
+	int				strategy;
+	unsigned char*			out_buf;			/* room for the zlib header, compressed data and trailer */
+	unsigned			out_cap;
+	unsigned			out_len;			/* compressed bytes, starting at out_buf + 2 */
+	unsigned long			adler;				/* Adler-32 checksum of the input */
+	int				result;
+} png_block_t;
+
+/* State of the parallel encoder. Filtered scanlines are collected into a batch of one block per thread; each
+   batch is compressed concurrently and written out in order. */
+typedef struct
+{
+	unsigned char*			buf;				/* dictionary for the batch, followed by the batch */
+	unsigned			dict_len;
+	unsigned			batch_len;
+	unsigned			threads;
+	int				started;			/* whether the zlib header has been written */
+	unsigned long			adler;				/* Adler-32 checksum of all input so far */
+	png_block_t*			blocks;
+} png_parallel_t;
+
+/* One batch of blocks handed to the worker pool */
+typedef struct
+{
+	png_block_t*			blocks;
+	unsigned			num_blocks;
+	unsigned			next;				/* index of the next unclaimed block (atomic) */
+} png_job_t;
+
+/* Worker pool shared by all parallel encoders. The workers are started when a batch first needs them and are
+   kept for later batches and images; the pool compresses one batch at a time. Protected by png_pool_lock. */
+static pthread_mutex_t png_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t png_pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t png_pool_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t png_pool_workers[PNG_MAX_THREADS - 1];
+static unsigned png_pool_num_workers;
+static png_job_t* png_pool_job;
+static unsigned long png_pool_job_seq;
+static unsigned png_pool_num_busy;
+
+/* Serializes the encoders using the pool */
+static pthread_mutex_t png_pool_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static png_alloc_t png_alloc;
 static png_free_t png_free;
 
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
 	size_t result;
-	if(png->read_fun)
+	if(png->mem)
+	{
+		size_t avail = (png->mem_size - png->mem_pos) / size;
+
+		result = avail < numel ? avail : numel;
+		if(out)
+			memcpy(out, png->mem + png->mem_pos, result * size);
+		png->mem_pos += result * size;
+	}
+	else if(png->read_fun)
 	{
 		result = png->read_fun(out, size, numel, png->user_pointer);
 	}
@@ -37,6 +117,8 @@ static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 		}
 	}
 
+	png->io_bytes += result * size;
+
 	return result;
 }
 
@@ -53,6 +135,8 @@ static size_t file_write(png_t* png, void* p, size_t size, size_t numel)
 		result = fwrite(p, size, numel, png->user_pointer);
 	}
 
+	png->io_bytes += result * size;
+
 	return result;
 }
 
@@ -157,10 +241,7 @@ static int png_read_ihdr(png_t* png)
 	file_read_ul(png, &length);
 
 	if(length != 13)
-	{
-		printf("%d\n", length);
 		return PNG_CRC_ERROR;
-	}
 
 	if(file_read(png, ihdr, 1, 13+4) != 13+4)
 		return PNG_EOF_ERROR;
@@ -251,17 +332,25 @@ void png_print_info(png_t* png)
 	printf("\tinterlace:\t%s\n",	png->interlace_method?"interlace":"no interlace");
 }
 
-int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
+/* Check the dimensions of a png: the width and height are limited by the png specification, and a scanline
+   (with its filter type byte) must fit in the int and unsigned byte counts used for it. The image as a whole
+   may be larger than 4 GiB; offsets into it are computed as size_t. */
+static int png_check_size(png_t* png)
 {
-	char header[8];
-	int result;
+	if(png->width > PNG_MAX_DIMENSION || png->height > PNG_MAX_DIMENSION)
+		return PNG_HEADER_ERROR;
 
-	png->read_fun = read_fun;
-	png->write_fun = 0;
-	png->user_pointer = user_pointer;
+	if((size_t)png->width * png->bpp + 1 > INT_MAX)
+		return PNG_NOT_SUPPORTED;
 
-	if(!read_fun && !user_pointer)
-		return PNG_WRONG_ARGUMENTS;
+	return PNG_NO_ERROR;
+}
+
+/* Read the png signature and header */
+static int png_read_header(png_t* png)
+{
+	char header[8];
+	int result;
 
 	if(file_read(png, header, 1, 8) != 8)
 		return PNG_EOF_ERROR;
@@ -273,14 +362,55 @@ int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 
 	png->bpp = (unsigned char)png_get_bpp(png);
 
+	if(result == PNG_NO_ERROR)
+		result = png_check_size(png);
+
 	return result;
 }
 
+int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
+{
+	png->read_fun = read_fun;
+	png->write_fun = 0;
+	png->user_pointer = user_pointer;
+	png->mem = 0;
+	png->streams = 0;
+	png->stats = 0;
+	png->io_bytes = 0;
+
+	if(!read_fun && !user_pointer)
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_read_header(png);
+}
+
+int png_open_mem_read(png_t* png, const void* data, size_t size)
+{
+	png->read_fun = 0;
+	png->write_fun = 0;
+	png->user_pointer = 0;
+	png->mem = data;
+	png->mem_size = size;
+	png->mem_pos = 0;
+	png->streams = 0;
+	png->stats = 0;
+	png->io_bytes = 0;
+
+	if(!data)
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_read_header(png);
+}
+
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer)
 {
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
+	png->mem = 0;
+	png->streams = 0;
+	png->stats = 0;
+	png->io_bytes = 0;
 
 	if(!write_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -325,9 +455,71 @@ int png_close_file(png_t* png)
 	return PNG_NO_ERROR;
 }
 
-static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
+void png_set_streams(png_t* png, png_streams_t* streams)
+{
+	png->streams = streams;
+}
+
+void png_set_stats(png_t* png, png_stats_t* stats)
+{
+	png->stats = stats;
+}
+
+/* Monotonic wall clock time in seconds, for png_stats_t */
+static double png_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void png_free_streams(png_streams_t* streams)
+{
+	if(streams->deflate_zs)
+	{
+		deflateEnd(streams->deflate_zs);
+		png_free(streams->deflate_zs);
+		streams->deflate_zs = NULL;
+	}
+
+	if(streams->inflate_zs)
+	{
+#if USE_ZLIB
+		inflateEnd(streams->inflate_zs);
+#else
+		z_inflateEnd(streams->inflate_zs);
+#endif
+		png_free(streams->inflate_zs);
+		streams->inflate_zs = NULL;
+	}
+}
+
+static int png_init_deflate(png_t* png, int level, int strategy)
 {
 	z_stream *stream;
+	png_streams_t *streams = png->streams;
+
+	png->level = level;
+	png->strategy = strategy;
+
+	/* reuse an idle stream with the same settings; deflateReset puts it back in its initial state */
+	if(streams && streams->deflate_zs && streams->level == level && streams->strategy == strategy)
+	{
+		png->zs = streams->deflate_zs;
+		streams->deflate_zs = NULL;
+
+		if(deflateReset(png->zs) != Z_OK)
+		{
+			deflateEnd(png->zs);
+			png_free(png->zs);
+			png->zs = NULL;
+			return PNG_ZLIB_ERROR;
+		}
+
+		return PNG_NO_ERROR;
+	}
+
 	png->zs = png_alloc(sizeof(z_stream));
 
 	stream = png->zs;
@@ -337,11 +529,12 @@ static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 
 	memset(stream, 0, sizeof(z_stream));
 
-	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+	if(deflateInit2(stream, level, Z_DEFLATED, MAX_WBITS, 8, strategy) != Z_OK)
+	{
+		png_free(stream);
+		png->zs = NULL;
 		return PNG_ZLIB_ERROR;
-
-	stream->next_in = data;
-	stream->avail_in = datalen;
+	}
 
 	return PNG_NO_ERROR;
 }
@@ -350,6 +543,24 @@ static int png_init_inflate(png_t* png)
 {
 #if USE_ZLIB
 	z_stream *stream;
+
+	/* reuse an idle stream; inflateReset puts it back in its initial state */
+	if(png->streams && png->streams->inflate_zs)
+	{
+		png->zs = png->streams->inflate_zs;
+		png->streams->inflate_zs = NULL;
+
+		if(inflateReset(png->zs) != Z_OK)
+		{
+			inflateEnd(png->zs);
+			png_free(png->zs);
+			png->zs = NULL;
+			return PNG_ZLIB_ERROR;
+		}
+
+		return PNG_NO_ERROR;
+	}
+
 	png->zs = png_alloc(sizeof(z_stream));
 #else
 	zl_stream *stream;
@@ -364,16 +575,17 @@ static int png_init_inflate(png_t* png)
 #if USE_ZLIB
 	memset(stream, 0, sizeof(z_stream));
 	if(inflateInit(stream) != Z_OK)
+	{
+		png_free(stream);
+		png->zs = NULL;
 		return PNG_ZLIB_ERROR;
+	}
 #else
 	memset(stream, 0, sizeof(zl_stream));
 	if(z_inflateInit(stream) != Z_OK)
 		return PNG_ZLIB_ERROR;
 #endif
 
-	stream->next_out = png->png_data;
-	stream->avail_out = png->png_datalen;
-
 	return PNG_NO_ERROR;
 }
 
@@ -384,6 +596,15 @@ static int png_end_deflate(png_t* png)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
+	/* keep the stream for the next png, unless one is kept already */
+	if(png->streams && !png->streams->deflate_zs)
+	{
+		png->streams->deflate_zs = stream;
+		png->streams->level = png->level;
+		png->streams->strategy = png->strategy;
+		return PNG_NO_ERROR;
+	}
+
 	deflateEnd(stream);
 
 	png_free(png->zs);
@@ -403,245 +624,557 @@ static int png_end_inflate(png_t* png)
 		return PNG_MEMORY_ERROR;
 
 #if USE_ZLIB
+	/* keep the stream for the next png, unless one is kept already */
+	if(png->streams && !png->streams->inflate_zs)
+	{
+		png->streams->inflate_zs = stream;
+		return PNG_NO_ERROR;
+	}
+
 	if(inflateEnd(stream) != Z_OK)
 #else
 	if(z_inflateEnd(stream) != Z_OK)
 #endif
-	{
-		printf("ZLIB says: %s\n", stream->msg);
 		return PNG_ZLIB_ERROR;
-	}
 
 	png_free(png->zs);
 
 	return PNG_NO_ERROR;
 }
 
-static int png_inflate(png_t* png, unsigned char* data, int len)
+/* Write the compressed data collected in png->chunk_buf as an IDAT chunk, and make the buffer available
+   to the deflater again */
+static int png_write_idat(png_t* png)
 {
-	int result;
-#if USE_ZLIB
 	z_stream *stream = png->zs;
-#else
-	zl_stream *stream = png->zs;
-#endif
+	unsigned length = PNG_WRITE_CHUNK_SIZE - stream->avail_out;
+	unsigned crc;
 
-	if(!stream)
-		return PNG_MEMORY_ERROR;
+	if(length > 0)
+	{
+		crc = crc32(0L, Z_NULL, 0);
+		crc = crc32(crc, png->chunk_buf, length+4);
 
-	stream->next_in = data;
-	stream->avail_in = len;
+		if(file_write_ul(png, length) != PNG_NO_ERROR)
+			return PNG_IO_ERROR;
 
-#if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
-#else
-	result = z_inflate(stream);
-#endif
+		if(file_write(png, png->chunk_buf, 1, length+4) != length+4)
+			return PNG_IO_ERROR;
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
+		if(file_write_ul(png, crc) != PNG_NO_ERROR)
+			return PNG_IO_ERROR;
 	}
 
-	if(stream->avail_in != 0)
-		return PNG_ZLIB_ERROR;
+	stream->next_out = png->chunk_buf + 4;
+	stream->avail_out = PNG_WRITE_CHUNK_SIZE;
 
 	return PNG_NO_ERROR;
 }
 
-static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
+/* Compress avail_in bytes at next_in, writing out an IDAT chunk each time the chunk buffer fills up. With
+   flush set to Z_FINISH, the deflate stream is completed and the last (partial) chunk is written too. */
+static int png_deflate(png_t* png, int flush)
 {
-	int result;
-
 	z_stream *stream = png->zs;
+	int result;
 
-	if(!stream)
-		return PNG_MEMORY_ERROR;
+	for(;;)
+	{
+		result = deflate(stream, flush);
 
-	stream->next_out = (unsigned char*)outdata;
-	stream->avail_out = outlen;
+		if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+			return PNG_ZLIB_ERROR;
 
-	result = deflate(stream, Z_SYNC_FLUSH);
+		if(stream->avail_out == 0 || result == Z_STREAM_END)
+		{
+			if(png_write_idat(png) != PNG_NO_ERROR)
+				return PNG_IO_ERROR;
+		}
 
-	*outwritten = outlen - stream->avail_out;
+		if(result == Z_STREAM_END)
+			break;
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
+		/* all of the input has been compressed, and there is space for any output still pending */
+		if(flush != Z_FINISH && stream->avail_in == 0 && stream->avail_out != 0)
+			break;
 	}
 
-	return result;
+	return PNG_NO_ERROR;
+}
+
+static int png_write_iend(png_t* png)
+{
+	unsigned crc;
+
+	file_write_ul(png, 0);
+	if(file_write(png, "IEND", 1, 4) != 4)
+		return PNG_IO_ERROR;
+	crc = crc32(0L, (const unsigned char *)"IEND", 4);
+
+	return file_write_ul(png, crc) == PNG_NO_ERROR ? PNG_NO_ERROR : PNG_IO_ERROR;
 }
 
-static int png_write_idats(png_t* png, unsigned char* data)
+/* Write len bytes of compressed data as one or more IDAT chunks */
+static int png_write_idat_data(png_t* png, const unsigned char* data, unsigned len)
 {
-	unsigned char *chunk;
-	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+	while(len > 0)
+	{
+		unsigned length = len < PNG_WRITE_CHUNK_SIZE ? len : PNG_WRITE_CHUNK_SIZE;
+		unsigned crc = crc32(0L, (const unsigned char*)"IDAT", 4);
 
-	(void)png_init_deflate;
-	(void)png_end_deflate;
-	(void)png_deflate;
+		crc = crc32(crc, data, length);
 
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
+		if(file_write_ul(png, length) != PNG_NO_ERROR)
+			return PNG_IO_ERROR;
 
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+		if(file_write(png, "IDAT", 1, 4) != 4 || file_write(png, (void*)data, 1, length) != length)
+			return PNG_IO_ERROR;
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
+		if(file_write_ul(png, crc) != PNG_NO_ERROR)
+			return PNG_IO_ERROR;
 
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+		data += length;
+		len -= length;
+	}
 
 	return PNG_NO_ERROR;
 }
 
-static int png_read_idat(png_t* png, unsigned length)
+/* Compress one block as raw deflate data. The block is primed with the preceding input as its dictionary, so
+   it compresses almost as well as if it were part of a single stream, and is ended with a sync flush (which
+   ends on a byte boundary) so the blocks can simply be concatenated. Run by the pool workers and the encoding
+   thread. */
+static void png_deflate_block(png_block_t* block)
 {
-#if DO_CRC_CHECKS
-	unsigned orig_crc;
-	unsigned calc_crc;
-#endif
+	z_stream stream;
+	unsigned bound;
+	int result;
+
+	memset(&stream, 0, sizeof(z_stream));
+	block->result = PNG_ZLIB_ERROR;
+
+	if(deflateInit2(&stream, block->level, Z_DEFLATED, -MAX_WBITS, 8, block->strategy) != Z_OK)
+		return;
 
-	if(!png->readbuf || png->readbuflen < length)
+	/* deflateBound assumes a single Z_FINISH; allow for the sync flush marker, zlib header and trailer */
+	bound = deflateBound(&stream, block->in_len) + 64;
+	if(block->out_cap < bound)
 	{
-		if (png->readbuf)
+		png_free(block->out_buf);
+		block->out_buf = png_alloc(bound);
+		block->out_cap = block->out_buf ? bound : 0;
+	}
+
+	if(!block->out_buf)
+	{
+		block->result = PNG_MEMORY_ERROR;
+	}
+	else if(block->dict_len == 0 ||
+		deflateSetDictionary(&stream, block->in - block->dict_len, block->dict_len) == Z_OK)
+	{
+		stream.next_in = (unsigned char*)block->in;
+		stream.avail_in = block->in_len;
+		stream.next_out = block->out_buf + 2;
+		stream.avail_out = block->out_cap - 6;
+
+		result = deflate(&stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+		if(block->last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0 && stream.avail_out != 0))
 		{
-			png_free(png->readbuf);
+			block->out_len = block->out_cap - 6 - stream.avail_out;
+			block->adler = adler32(adler32(0L, Z_NULL, 0), block->in, block->in_len);
+			block->result = PNG_NO_ERROR;
 		}
-		png->readbuf = png_alloc(length);
-		png->readbuflen = length;
 	}
 
-	if(!png->readbuf)
+	deflateEnd(&stream);
+}
+
+/* Claim and compress blocks of the job until it has none left */
+static void png_run_blocks(png_job_t* job)
+{
+	unsigned i;
+
+	while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num_blocks)
+		png_deflate_block(&job->blocks[i]);
+}
+
+/* Worker of the pool. arg is the job sequence number when it was started, so it waits for the next job. */
+static void* png_pool_worker(void* arg)
+{
+	unsigned long seen_seq = (unsigned long)(size_t)arg;
+	png_job_t* job;
+
+	pthread_mutex_lock(&png_pool_lock);
+	for(;;)
 	{
-		return PNG_MEMORY_ERROR;
+		while(png_pool_job_seq == seen_seq)
+			pthread_cond_wait(&png_pool_work_cond, &png_pool_lock);
+
+		seen_seq = png_pool_job_seq;
+		job = png_pool_job;
+		pthread_mutex_unlock(&png_pool_lock);
+
+		png_run_blocks(job);
+
+		pthread_mutex_lock(&png_pool_lock);
+		if(--png_pool_num_busy == 0)
+			pthread_cond_signal(&png_pool_done_cond);
 	}
 
-	if(file_read(png, png->readbuf, 1, length) != length)
+	return 0;
+}
+
+/* Compress all blocks of the job on the worker pool and the calling thread, starting more workers if the job
+   has more blocks than there are threads. If another encoder is using the pool, or no worker can be started,
+   the calling thread compresses the blocks by itself. */
+static void png_pool_run(png_job_t* job)
+{
+	if(job->num_blocks < 2 || pthread_mutex_trylock(&png_pool_dispatch_lock) != 0)
 	{
-		return PNG_FILE_ERROR;
+		png_run_blocks(job);
+		return;
 	}
 
-#if DO_CRC_CHECKS
-	calc_crc = crc32(0L, Z_NULL, 0);
-	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
-	calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
+	/* only this thread changes the job sequence number, so it can be read without png_pool_lock */
+	while(png_pool_num_workers < job->num_blocks - 1 &&
+	      pthread_create(&png_pool_workers[png_pool_num_workers], NULL, png_pool_worker,
+			     (void*)(size_t)png_pool_job_seq) == 0)
+		png_pool_num_workers++;
 
-	file_read_ul(png, &orig_crc);
+	if(png_pool_num_workers > 0)
+	{
+		pthread_mutex_lock(&png_pool_lock);
+		png_pool_job = job;
+		png_pool_job_seq++;
+		png_pool_num_busy = png_pool_num_workers;
+		pthread_cond_broadcast(&png_pool_work_cond);
+		pthread_mutex_unlock(&png_pool_lock);
+	}
 
-	if(orig_crc != calc_crc)
+	png_run_blocks(job);
+
+	if(png_pool_num_workers > 0)
 	{
-		return PNG_CRC_ERROR;
+		pthread_mutex_lock(&png_pool_lock);
+		while(png_pool_num_busy > 0)
+			pthread_cond_wait(&png_pool_done_cond, &png_pool_lock);
+		png_pool_job = NULL;
+		pthread_mutex_unlock(&png_pool_lock);
 	}
-#else
-	file_read_ul(png);
-#endif
 
-	return png_inflate(png, png->readbuf, length);
+	pthread_mutex_unlock(&png_pool_dispatch_lock);
 }
 
-static int png_process_chunk(png_t* png)
+/* Compress the batch collected by the parallel encoder, one block per thread, and write it out. With last set,
+   the batch ends the image data. */
+static int png_parallel_flush(png_t* png, int last)
 {
+	png_parallel_t* par = png->pz;
+	unsigned num_blocks = (par->batch_len + PNG_BLOCK_SIZE - 1) / PNG_BLOCK_SIZE;
+	png_job_t job;
+	unsigned keep;
+	unsigned i;
 	int result = PNG_NO_ERROR;
-	unsigned type;
-	unsigned length;
 
-	file_read_ul(png, &length);
+	if(num_blocks == 0)
+		num_blocks = 1; /* an empty last block still ends the stream */
 
-	if(file_read(png, &type, 1, 4) != 4)
-		return PNG_FILE_ERROR;
+	for(i = 0; i < num_blocks; i++)
+	{
+		png_block_t* block = &par->blocks[i];
+		unsigned offset = i * PNG_BLOCK_SIZE;
 
-	if(type == *(unsigned int*)"IDAT")	/* if we found an idat, all other idats should be followed with no other chunks in between */
+		block->in = par->buf + PNG_DICT_SIZE + offset;
+		block->in_len = par->batch_len - offset < PNG_BLOCK_SIZE ? par->batch_len - offset : PNG_BLOCK_SIZE;
+		block->dict_len = i > 0 ? PNG_DICT_SIZE : par->dict_len;
+		block->last = last && i == num_blocks - 1;
+	}
+
+	job.blocks = par->blocks;
+	job.num_blocks = num_blocks;
+	job.next = 0;
+	png_pool_run(&job);
+
+	for(i = 0; i < num_blocks && result == PNG_NO_ERROR; i++)
 	{
-		if(!png->png_data) /* first IDAT */
+		png_block_t* block = &par->blocks[i];
+		unsigned char* data = block->out_buf + 2;
+		unsigned len = block->out_len;
+
+		result = block->result;
+		if(result != PNG_NO_ERROR)
+			break;
+
+		par->adler = adler32_combine(par->adler, block->adler, block->in_len);
+
+		if(!par->started)
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
-			png->png_data = png_alloc(png->png_datalen);
+			/* zlib header, as deflate would write it for the compression level */
+			int level = block->level == Z_DEFAULT_COMPRESSION ? 6 : block->level;
+			unsigned header = (0x78 << 8) | ((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+
+			header += 31 - header % 31;
+			data -= 2;
+			len += 2;
+			data[0] = header >> 8;
+			data[1] = header & 0xff;
+			par->started = 1;
 		}
 
-		if(!png->png_data)
-			return PNG_MEMORY_ERROR;
-
-		if(!png->zs)
+		if(block->last)
 		{
-			result = png_init_inflate(png);
-			if(result != PNG_NO_ERROR)
-				return result;
+			set_ul(data + len, par->adler);
+			len += 4;
 		}
 
-		return png_read_idat(png, length);
-	}
-	else if(type == *(unsigned int*)"IEND")
-	{
-		return PNG_DONE;
-	}
-	else
-	{
-		file_read(png, 0, 1, length + 4); /* unknown chunk */
+		result = png_write_idat_data(png, data, len);
 	}
 
+	/* the end of this batch (and of the dictionary before it) is the dictionary for the next one */
+	keep = par->dict_len + par->batch_len < PNG_DICT_SIZE ? par->dict_len + par->batch_len : PNG_DICT_SIZE;
+	memmove(par->buf + PNG_DICT_SIZE - keep, par->buf + PNG_DICT_SIZE + par->batch_len - keep, keep);
+	par->dict_len = keep;
+	par->batch_len = 0;
+
 	return result;
 }
 
-static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
+/* Add len bytes of filtered scanlines to the parallel encoder, compressing each batch once it is full */
+static int png_parallel_write(png_t* png, const unsigned char* data, unsigned len)
 {
-	int i;
-	unsigned char a = 0;
+	png_parallel_t* par = png->pz;
+	unsigned batch_cap = par->threads * PNG_BLOCK_SIZE;
+	int result;
 
-	for(i = 0; i < len; i++)
+	while(len > 0)
 	{
-		if(i >= stride)
-			a = out[i - stride];
+		unsigned n;
 
-		out[i] = in[i] + a;
+		/* a full batch is only compressed once more data arrives, so the last batch is never empty */
+		if(par->batch_len == batch_cap)
+		{
+			result = png_parallel_flush(png, 0);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		n = batch_cap - par->batch_len < len ? batch_cap - par->batch_len : len;
+		memcpy(par->buf + PNG_DICT_SIZE + par->batch_len, data, n);
+		par->batch_len += n;
+		data += n;
+		len -= n;
 	}
+
+	return PNG_NO_ERROR;
 }
 
-static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static int png_init_parallel(png_t* png, const png_write_options_t* options)
 {
-	(void) stride;
+	png_parallel_t* par = png_alloc(sizeof(png_parallel_t));
+	unsigned i;
 
-	int i;
+	png->pz = par;
+	if(!par)
+		return PNG_MEMORY_ERROR;
 
-	if(prev_line)
+	memset(par, 0, sizeof(png_parallel_t));
+	par->threads = options->threads;
+	par->adler = adler32(0L, Z_NULL, 0);
+	par->buf = png_alloc(PNG_DICT_SIZE + par->threads * PNG_BLOCK_SIZE);
+	par->blocks = png_alloc(par->threads * sizeof(png_block_t));
+
+	if(!par->buf || !par->blocks)
+		return PNG_MEMORY_ERROR;
+
+	memset(par->blocks, 0, par->threads * sizeof(png_block_t));
+	for(i = 0; i < par->threads; i++)
 	{
-        for(i = 0; i < len; i++)
-		out[i] = in[i] + prev_line[i];
+		par->blocks[i].level = options->level;
+		par->blocks[i].strategy = options->strategy;
 	}
-	else
-		memcpy(out, in, len);
+
+	return PNG_NO_ERROR;
 }
 
-static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_end_parallel(png_t* png)
 {
-	int i;
-	unsigned char a = 0;
-	unsigned char b = 0;
-	unsigned int sum = 0;
+	png_parallel_t* par = png->pz;
+	unsigned i;
 
-	for(i = 0; i < len; i++)
-	{
-		if(prev_line)
-			b = prev_line[i];
+	if(!par)
+		return;
 
-		if(i >= stride)
-			a = out[i - stride];
+	if(par->blocks)
+	{
+		for(i = 0; i < par->threads; i++)
+			png_free(par->blocks[i].out_buf);
+	}
 
-		sum = a;
-		sum += b;
+	png_free(par->blocks);
+	png_free(par->buf);
+	png_free(par);
+	png->pz = NULL;
+}
+
+/* Make more compressed data available to the inflater. Reads the next piece (at most PNG_READ_CHUNK_SIZE bytes)
+   of the current IDAT chunk, moving on to the next IDAT chunk (skipping any other chunks) when the current one
+   is used up. If the png is in memory, the inflater reads the piece where it is instead of from a copy. */
+static int png_read_idat_data(png_t* png)
+{
+	z_stream *stream = png->zs;
+	const unsigned char *data;
+	unsigned length;
+	unsigned type;
+	unsigned orig_crc;
+
+	while(png->idat_left == 0)
+	{
+		file_read_ul(png, &length);
+
+		if(file_read(png, &type, 1, 4) != 4)
+			return PNG_FILE_ERROR;
+
+		if(type == *(unsigned int*)"IDAT")
+		{
+			png->idat_left = length;
+			png->idat_crc = crc32(0L, (unsigned char*)"IDAT", 4);
+
+			if(length == 0)
+			{
+				if(file_read_ul(png, &orig_crc) != PNG_NO_ERROR)
+					return PNG_FILE_ERROR;
+#if DO_CRC_CHECKS
+				if(orig_crc != png->idat_crc)
+					return PNG_CRC_ERROR;
+#endif
+			}
+		}
+		else if(type == *(unsigned int*)"IEND")
+		{
+			return PNG_EOF_ERROR; /* image data ended early */
+		}
+		else
+		{
+			file_read(png, 0, 1, length + 4); /* unknown chunk */
+		}
+	}
+
+	length = png->idat_left < PNG_READ_CHUNK_SIZE ? png->idat_left : PNG_READ_CHUNK_SIZE;
+
+	if(png->mem)
+	{
+		data = png->mem + png->mem_pos;
+		if(file_read(png, 0, 1, length) != length)
+			return PNG_FILE_ERROR;
+	}
+	else
+	{
+		data = png->readbuf;
+		if(file_read(png, png->readbuf, 1, length) != length)
+			return PNG_FILE_ERROR;
+	}
+
+#if DO_CRC_CHECKS
+	png->idat_crc = crc32(png->idat_crc, data, length);
+#endif
+	png->idat_left -= length;
+
+	if(png->idat_left == 0)
+	{
+		if(file_read_ul(png, &orig_crc) != PNG_NO_ERROR)
+			return PNG_FILE_ERROR;
+#if DO_CRC_CHECKS
+		if(orig_crc != png->idat_crc)
+			return PNG_CRC_ERROR;
+#endif
+	}
+
+	stream->next_in = (unsigned char*)data;
+	stream->avail_in = length;
+
+	return PNG_NO_ERROR;
+}
+
+/* Inflate the next filtered scanline (filter byte plus width*bpp bytes) into png->row_buf */
+static int png_inflate_row(png_t* png)
+{
+	z_stream *stream = png->zs;
+	int result;
+
+	stream->next_out = png->row_buf;
+	stream->avail_out = png->width * png->bpp + 1;
+
+	while(stream->avail_out > 0)
+	{
+		if(stream->avail_in == 0)
+		{
+			result = png_read_idat_data(png);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		result = inflate(stream, Z_NO_FLUSH);
+
+		if(result == Z_STREAM_END)
+			break;
+
+		if(result != Z_OK)
+			return PNG_ZLIB_ERROR;
+	}
+
+	if(stream->avail_out != 0)
+		return PNG_EOF_ERROR;
+
+	return PNG_NO_ERROR;
+}
+
+static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
+{
+	int i;
+	unsigned char a = 0;
+
+	for(i = 0; i < len; i++)
+	{
+		if(i >= stride)
+			a = out[i - stride];
+
+		out[i] = in[i] + a;
+	}
+}
+
+static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	(void) stride;
+
+	int i;
+
+	if(prev_line)
+	{
+        for(i = 0; i < len; i++)
+		out[i] = in[i] + prev_line[i];
+	}
+	else
+		memcpy(out, in, len);
+}
+
+static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	int i;
+	unsigned char a = 0;
+	unsigned char b = 0;
+	unsigned int sum = 0;
+
+	for(i = 0; i < len; i++)
+	{
+		if(prev_line)
+			b = prev_line[i];
+
+		if(i >= stride)
+			a = out[i - stride];
+
+		sum = a;
+		sum += b;
 
 		out[i] = (char)(in[i] + sum/2);
 	}
@@ -700,139 +1233,728 @@ static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out,
 	}
 }
 
-static int png_filter(png_t* png, unsigned char* data)
+/* Prediction of a byte by the given filter type, from the bytes to its left (a), above (b) and above-left (c) */
+static unsigned char png_predict(int filter, unsigned char a, unsigned char b, unsigned char c)
 {
-	(void) png;
-	(void) data;
-	return PNG_NO_ERROR;
+	switch(filter)
+	{
+	case PNG_FILTER_SUB:		return a;
+	case PNG_FILTER_UP:		return b;
+	case PNG_FILTER_AVERAGE:	return (unsigned char)((a + b) >> 1);
+	case PNG_FILTER_PAETH:		return png_paeth(a, b, c);
+	default:			return 0;
+	}
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+/* Filter bytes [start, len) of the scanline in (whose previous scanline is prev_line) into out, returning the
+   sum of the absolute values of the filtered bytes taken as signed, which estimates how well they compress */
+static unsigned long png_encode_scalar(int filter, int stride, const unsigned char* in, const unsigned char* prev_line,
+				       unsigned char* out, unsigned start, unsigned len)
 {
 	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
-
-	int stride = png->bpp;
+	unsigned long sum = 0;
 
-	while(pos < png->png_datalen)
+	for(i = start; i < len; i++)
 	{
-		unsigned char filter = filtered[pos];
+		unsigned char a = i >= (unsigned)stride ? in[i - stride] : 0;
+		unsigned char c = i >= (unsigned)stride ? prev_line[i - stride] : 0;
+		unsigned char d = in[i] - png_predict(filter, a, prev_line[i], c);
+
+		out[i] = d;
+		sum += d < 128 ? d : 256 - d;
+	}
 
-		pos++;
+	return sum;
+}
 
-		if(png->depth == 16)
-		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
-		}
+#ifdef __SSE2__
+/* Paeth predictor of eight 16-bit lanes */
+static __m128i png_paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i pa = _mm_sub_epi16(b, c);
+	__m128i pb = _mm_sub_epi16(a, c);
+	__m128i pc = _mm_add_epi16(pa, pb);
+	__m128i not_a;
+	__m128i not_b;
+	__m128i bc;
+
+	pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+	/* a if pa <= pb and pa <= pc, otherwise b if pb <= pc, otherwise c */
+	not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	not_b = _mm_cmpgt_epi16(pb, pc);
+	bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+
+	return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+
+/* SSE2 version of png_encode_scalar for a whole scanline. Every filtered byte depends only on unfiltered bytes,
+   so 16 bytes are filtered at a time; the first stride bytes (which have no left neighbour) and the tail are
+   done by png_encode_scalar. */
+static unsigned long png_encode_sse2(int filter, int stride, const unsigned char* in, const unsigned char* prev_line,
+				     unsigned char* out, unsigned len)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi8(1);
+	__m128i acc = zero;
+	unsigned long sum = png_encode_scalar(filter, stride, in, prev_line, out, 0, (unsigned)stride);
+	unsigned i;
+
+	for(i = stride; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(in + i - stride));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev_line + i));
+		__m128i c = _mm_loadu_si128((const __m128i*)(prev_line + i - stride));
+		__m128i p;
+		__m128i d;
 
 		switch(filter)
 		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
+		case PNG_FILTER_SUB:
+			p = a;
 			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
+		case PNG_FILTER_UP:
+			p = b;
 			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
+		case PNG_FILTER_AVERAGE:
+			/* _mm_avg_epu8 rounds up, the filter rounds down */
+			p = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
 			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
+		case PNG_FILTER_PAETH:
+			p = _mm_packus_epi16(
+				png_paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+				png_paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
 			break;
 		default:
-			return PNG_UNKNOWN_FILTER;
+			p = zero;
+			break;
 		}
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+		d = _mm_sub_epi8(x, p);
+		_mm_storeu_si128((__m128i*)(out + i), d);
+
+		/* |d| as a signed byte is min(d, -d) as an unsigned byte */
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(d, _mm_sub_epi8(zero, d)), zero));
+	}
+
+	sum += (unsigned long)_mm_cvtsi128_si32(acc) + (unsigned long)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+
+	return sum + png_encode_scalar(filter, stride, in, prev_line, out, i, len);
+}
+#endif
+
+/* Unfilter kernel for one filter type: in is the filtered scanline, prev_line the previous unfiltered one */
+typedef void (*png_unfilter_t)(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len);
+
+#ifdef __SSE2__
+/* SSE2 unfilter kernels for 3 and 4 bytes per pixel, giving exactly the same results as png_filter_sub,
+   png_filter_up, png_filter_average and png_filter_paeth. Each pixel depends on the one to its left, so Sub,
+   Average and Paeth go a pixel at a time, but do all bytes of the pixel at once and without branches. */
+
+static inline __m128i png_load_pixel(const unsigned char* p, int bpp)
+{
+	unsigned v;
+	unsigned short lo;
+
+	if(bpp == 4)
+	{
+		memcpy(&v, p, 4);
+	}
+	else
+	{
+		memcpy(&lo, p, 2);
+		v = lo | (unsigned)p[2] << 16;
+	}
+
+	return _mm_cvtsi32_si128((int)v);
+}
+
+static inline void png_store_pixel(unsigned char* p, __m128i pixel, int bpp)
+{
+	unsigned v = (unsigned)_mm_cvtsi128_si32(pixel);
+
+	if(bpp == 4)
+	{
+		memcpy(p, &v, 4);
+	}
+	else
+	{
+		memcpy(p, &v, 2);
+		p[2] = (unsigned char)(v >> 16);
+	}
+}
+
+static inline void png_unfilter_sub_sse2(int bpp, const unsigned char* in, unsigned char* out, unsigned len)
+{
+	__m128i a = _mm_setzero_si128();
+	unsigned i;
+
+	for(i = 0; i < len; i += bpp)
+	{
+		a = _mm_add_epi8(a, png_load_pixel(in + i, bpp));
+		png_store_pixel(out + i, a, bpp);
+	}
+}
+
+static inline void png_unfilter_average_sse2(int bpp, const unsigned char* in, unsigned char* out,
+					     const unsigned char* prev_line, unsigned len)
+{
+	__m128i ones = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	unsigned i;
+
+	for(i = 0; i < len; i += bpp)
+	{
+		__m128i b = png_load_pixel(prev_line + i, bpp);
+
+		/* _mm_avg_epu8 rounds up, the filter rounds down */
+		__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+
+		a = _mm_add_epi8(png_load_pixel(in + i, bpp), avg);
+		png_store_pixel(out + i, a, bpp);
+	}
+}
+
+static inline void png_unfilter_paeth_sse2(int bpp, const unsigned char* in, unsigned char* out,
+					   const unsigned char* prev_line, unsigned len)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero; /* left and above-left pixels, in 16-bit lanes */
+	__m128i c = zero;
+	unsigned i;
+
+	for(i = 0; i < len; i += bpp)
+	{
+		__m128i b = _mm_unpacklo_epi8(png_load_pixel(prev_line + i, bpp), zero);
+		__m128i x = _mm_add_epi8(png_load_pixel(in + i, bpp), _mm_packus_epi16(png_paeth_epi16(a, b, c), zero));
+
+		png_store_pixel(out + i, x, bpp);
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+	}
+}
+
+/* Up has no dependency between bytes in a scanline, so it goes 16 bytes at a time for any pixel size */
+static void png_unfilter_up_sse2(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	unsigned i;
+
+	for(i = 0; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev_line + i));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(x, b));
+	}
+
+	for(; i < len; i++)
+		out[i] = in[i] + prev_line[i];
+}
+
+static void png_unfilter_sub3(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	(void)prev_line;
+	png_unfilter_sub_sse2(3, in, out, len);
+}
+
+static void png_unfilter_sub4(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	(void)prev_line;
+	png_unfilter_sub_sse2(4, in, out, len);
+}
+
+static void png_unfilter_average3(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	png_unfilter_average_sse2(3, in, out, prev_line, len);
+}
+
+static void png_unfilter_average4(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	png_unfilter_average_sse2(4, in, out, prev_line, len);
+}
+
+static void png_unfilter_paeth3(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	png_unfilter_paeth_sse2(3, in, out, prev_line, len);
+}
+
+static void png_unfilter_paeth4(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, unsigned len)
+{
+	png_unfilter_paeth_sse2(4, in, out, prev_line, len);
+}
+#endif
+
+/* Return the unfilter kernels specialized for the pixel size, indexed by filter type, or 0 if there are none
+   (the png_filter_* functions are used instead) */
+static const png_unfilter_t* png_unfilter_kernels(int bpp)
+{
+#ifdef __SSE2__
+	static const png_unfilter_t kernels3[5] = {
+		0, png_unfilter_sub3, png_unfilter_up_sse2, png_unfilter_average3, png_unfilter_paeth3
+	};
+	static const png_unfilter_t kernels4[5] = {
+		0, png_unfilter_sub4, png_unfilter_up_sse2, png_unfilter_average4, png_unfilter_paeth4
+	};
+
+	if(bpp == 3)
+		return kernels3;
+	if(bpp == 4)
+		return kernels4;
+#else
+	(void)bpp;
+#endif
+	return 0;
+}
+
+/* Filter one scanline, storing the filter type byte and filtered bytes in png->row_buf. With the adaptive policy,
+   every filter type is tried and the one with the smallest sum of absolute differences is kept. */
+static void png_filter_row(png_t* png, const unsigned char* row, const unsigned char* prev_line)
+{
+	unsigned len = png->width * png->bpp;
+	int first = png->filter == PNG_FILTER_ADAPTIVE ? PNG_FILTER_NONE : png->filter;
+	int last = png->filter == PNG_FILTER_ADAPTIVE ? PNG_FILTER_PAETH : png->filter;
+	unsigned long best = 0;
+	int filter;
+
+	for(filter = first; filter <= last; filter++)
+	{
+		unsigned char* out = filter == first ? png->row_buf : png->filter_buf;
+		unsigned long sum;
+
+		if(first == last && filter == PNG_FILTER_NONE)
+		{
+			memcpy(out + 1, row, len);
+			sum = 0;
+		}
+		else
+		{
+#ifdef __SSE2__
+			sum = png_encode_sse2(filter, png->bpp, row, prev_line, out + 1, len);
+#else
+			sum = png_encode_scalar(filter, png->bpp, row, prev_line, out + 1, 0, len);
+#endif
+		}
+
+		out[0] = (unsigned char)filter;
+
+		if(filter == first || sum < best)
+		{
+			best = sum;
+			if(out != png->row_buf)
+			{
+				png->filter_buf = png->row_buf;
+				png->row_buf = out;
+			}
+		}
+	}
+}
+
+int png_unfilter(int filter, int bpp, const unsigned char* in, unsigned char* out, const unsigned char* prev_line,
+		 unsigned len, int reference)
+{
+	const png_unfilter_t* kernels = reference ? 0 : png_unfilter_kernels(bpp);
+	unsigned char* filtered = (unsigned char*)in;
+	unsigned char* prev = (unsigned char*)prev_line;
+
+	/* the first scanline (with no previous one) always uses the reference functions */
+	if(kernels && prev_line && filter >= 1 && filter <= 4)
+	{
+		kernels[filter](in, out, prev_line, len);
+		return PNG_NO_ERROR;
+	}
+
+	switch(filter)
+	{
+	case 0: /* none */
+		memcpy(out, in, len);
+		break;
+	case 1: /* sub */
+		png_filter_sub(bpp, filtered, out, len);
+		break;
+	case 2: /* up */
+		png_filter_up(bpp, filtered, out, prev, len);
+		break;
+	case 3: /* average */
+		png_filter_average(bpp, filtered, out, prev, len);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(bpp, filtered, out, prev, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
 	}
 
 	return PNG_NO_ERROR;
 }
 
-int png_get_data(png_t* png, unsigned char* data)
+/* Unfilter one scanline. filtered points to the filter type byte, prev_line is the previous unfiltered
+   scanline (or 0 for the first one). */
+static int png_unfilter_row(png_t* png, unsigned char* filtered, unsigned char* out, unsigned char* prev_line)
 {
-	int result = PNG_NO_ERROR;
+	unsigned i;
+	unsigned char filter = filtered[0];
+	unsigned len = png->width * png->bpp;
+
+	filtered++;
+
+	if(png->depth == 16)
+	{
+		for(i = 0; i < len; i+=2)
+		{
+			*(short*)(filtered+i) = (filtered[i] << 8) | filtered[i+1];
+		}
+	}
+
+	return png_unfilter(filter, png->bpp, filtered, out, prev_line, len, 0);
+}
+
+int png_read_begin(png_t* png)
+{
+	unsigned rowlen = png->width * png->bpp;
+	int result;
 
 	png->zs = NULL;
 	png->png_datalen = 0;
 	png->png_data = NULL;
-	png->readbuf = NULL;
-	png->readbuflen = 0;
+	png->row_index = 0;
+	png->idat_left = 0;
+	png->readbuflen = png->mem ? 0 : PNG_READ_CHUNK_SIZE;
+	png->readbuf = png->mem ? NULL : png_alloc(png->readbuflen);
+	png->row_buf = png_alloc((size_t)rowlen + 1);
+	png->row_window = png_alloc(2 * (size_t)rowlen);
+
+	if((!png->mem && !png->readbuf) || !png->row_buf || !png->row_window)
+	{
+		png_read_end(png);
+		return PNG_MEMORY_ERROR;
+	}
 
-	while(result == PNG_NO_ERROR)
+	result = png_init_inflate(png);
+	if(result != PNG_NO_ERROR)
 	{
-		result = png_process_chunk(png);
+		png_read_end(png);
+		return result;
 	}
 
-	if (png->readbuf)
+	return PNG_NO_ERROR;
+}
+
+/* Read the next scanline, unfiltering it into out; prev_line is the previous unfiltered scanline */
+static int png_read_row_into(png_t* png, unsigned char* out, unsigned char* prev_line)
+{
+	int result;
+
+	double start = 0.0, inflated = 0.0;
+
+	if(png->row_index >= png->height)
+		return PNG_DONE;
+
+	if(png->stats)
+		start = png_now();
+
+	result = png_inflate_row(png);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	if(png->stats)
+		inflated = png_now();
+
+	result = png_unfilter_row(png, png->row_buf, out, prev_line);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	if(png->stats)
 	{
-		png_free(png->readbuf);
-		png->readbuflen = 0;
+		png->stats->inflate_time += inflated - start;
+		png->stats->unfilter_time += png_now() - inflated;
 	}
-	if (png->zs)
+
+	png->row_index++;
+
+	return PNG_NO_ERROR;
+}
+
+int png_read_row(png_t* png, unsigned char** row)
+{
+	unsigned rowlen = png->width * png->bpp;
+	unsigned char *out = png->row_window + (png->row_index & 1) * rowlen;
+	unsigned char *prev = png->row_index ? png->row_window + ((png->row_index - 1) & 1) * rowlen : 0;
+	int result = png_read_row_into(png, out, prev);
+
+	if(result == PNG_NO_ERROR)
+		*row = out;
+
+	return result;
+}
+
+int png_read_end(png_t* png)
+{
+	if(png->stats)
 	{
-		png_end_inflate(png);
+		png->stats->bytes_read += png->io_bytes;
+		png->io_bytes = 0;
 	}
 
-	if(result != PNG_DONE)
+	if(png->zs)
 	{
-		png_free(png->png_data);
-		return result;
+		png_end_inflate(png);
+		png->zs = NULL;
 	}
 
-	result = png_unfilter(png, data);
+	png_free(png->readbuf);
+	png_free(png->row_buf);
+	png_free(png->row_window);
+	png->readbuf = NULL;
+	png->row_buf = NULL;
+	png->row_window = NULL;
+	png->readbuflen = 0;
 
-	png_free(png->png_data);
+	return PNG_NO_ERROR;
+}
+
+int png_get_data(png_t* png, unsigned char* data)
+{
+	unsigned rowlen = png->width * png->bpp;
+	unsigned i;
+	int result = png_read_begin(png);
+
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	/* unfilter straight into data, using the previous row of data as the previous scanline */
+	for(i = 0; i < png->height && result == PNG_NO_ERROR; i++)
+	{
+		result = png_read_row_into(png, data + (size_t)i * rowlen, i ? data + (size_t)(i - 1) * rowlen : 0);
+	}
+
+	png_read_end(png);
 
 	return result;
 }
 
+static void png_copy_row(unsigned char* dst, const unsigned char* src, unsigned len)
+{
+	memcpy(dst, src, len);
+}
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
 {
-	//int i;
+	return png_set_data_converted(png, width, height, depth, color, data, png_copy_row, 0);
+}
+
+int png_set_data_converted(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data,
+			   png_convert_row_t convert, const png_write_options_t* options)
+{
+	unsigned rowlen;
 	unsigned i;
-	unsigned char *filtered;
+	int result = png_write_begin(png, width, height, depth, color, options);
+	int end_result;
+
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	rowlen = png->width * png->bpp;
+
+	for(i = 0; i < height && result == PNG_NO_ERROR; i++)
+	{
+		result = png_write_row_converted(png, data + (size_t)i * rowlen, convert);
+	}
+
+	end_result = png_write_end(png);
+
+	return result != PNG_NO_ERROR ? result : end_result;
+}
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color, const png_write_options_t* options)
+{
+	static const png_write_options_t default_options = { -1, 0, PNG_FILTER_ADAPTIVE, 1 };
+	size_t rowlen;
+	int result;
+
+	if(!options)
+		options = &default_options;
+
+	png->zs = NULL;
+	png->pz = NULL;
+	png->row_buf = NULL;
+	png->filter_buf = NULL;
+	png->row_window = NULL;
+	png->chunk_buf = NULL;
+
+	if(options->level < Z_DEFAULT_COMPRESSION || options->level > Z_BEST_COMPRESSION ||
+	   options->strategy < Z_DEFAULT_STRATEGY || options->strategy > Z_FIXED ||
+	   options->filter < PNG_FILTER_NONE || options->filter > PNG_FILTER_ADAPTIVE ||
+	   options->threads < 0 || options->threads > PNG_MAX_THREADS)
+		return PNG_WRONG_ARGUMENTS;
+
 	png->width = width;
 	png->height = height;
 	png->depth = depth;
 	png->color_type = color;
 	png->bpp = png_get_bpp(png);
+	png->row_index = 0;
+	png->filter = options->filter;
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	result = png_check_size(png);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	rowlen = (size_t)width * png->bpp;
+	png->row_buf = png_alloc(rowlen + 1);
+	png->filter_buf = png_alloc(rowlen + 1);
+	png->row_window = png_alloc(2 * rowlen);
+	png->chunk_buf = png_alloc(PNG_WRITE_CHUNK_SIZE + 4);
 
-	for(i = 0; i < png->height; i++)
+	if(!png->row_buf || !png->filter_buf || !png->row_window || !png->chunk_buf)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+		png_write_end(png);
+		return PNG_MEMORY_ERROR;
 	}
 
-	png_filter(png, filtered);
-	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	memset(png->row_window, 0, 2 * rowlen);
 
-	png_free(filtered);
+	/* use the parallel encoder only if there is more than one block of image data to share */
+	if(options->threads > 1 && (double)(rowlen + 1) * height > PNG_BLOCK_SIZE)
+	{
+		result = png_init_parallel(png, options);
+	}
+	else
+	{
+		result = png_init_deflate(png, options->level, options->strategy);
+		if(result == PNG_NO_ERROR)
+		{
+			memcpy(png->chunk_buf, "IDAT", 4);
+			((z_stream*)png->zs)->next_out = png->chunk_buf + 4;
+			((z_stream*)png->zs)->avail_out = PNG_WRITE_CHUNK_SIZE;
+		}
+	}
+
+	if(result != PNG_NO_ERROR)
+	{
+		png_write_end(png);
+		return result;
+	}
+
+	png_write_ihdr(png);
 
 	return PNG_NO_ERROR;
 }
 
+int png_write_row(png_t* png, unsigned char* row)
+{
+	return png_write_row_converted(png, row, png_copy_row);
+}
+
+int png_write_row_converted(png_t* png, unsigned char* row, png_convert_row_t convert)
+{
+	z_stream *stream = png->zs;
+	unsigned rowlen = png->width * png->bpp;
+
+	/* the previous scanline is kept unfiltered for the filters to refer to; before the first scanline,
+	   it is all zeros */
+	unsigned char *cur = png->row_window + (png->row_index & 1) * rowlen;
+	unsigned char *prev = png->row_window + ((png->row_index + 1) & 1) * rowlen;
+	double start = 0.0, converted = 0.0, filtered = 0.0;
+	int result;
+
+	if(png->row_index >= png->height)
+		return PNG_DONE;
+
+	if(png->stats)
+		start = png_now();
+
+	convert(cur, row, rowlen);
+
+	if(png->stats)
+		converted = png_now();
+
+	png_filter_row(png, cur, prev);
+	png->row_index++;
+
+	if(png->stats)
+		filtered = png_now();
+
+	if(png->pz)
+	{
+		result = png_parallel_write(png, png->row_buf, rowlen + 1);
+	}
+	else
+	{
+		stream->next_in = png->row_buf;
+		stream->avail_in = rowlen + 1;
+		result = png_deflate(png, Z_NO_FLUSH);
+	}
+
+	if(png->stats)
+	{
+		png->stats->convert_time += converted - start;
+		png->stats->filter_time += filtered - converted;
+		png->stats->deflate_time += png_now() - filtered;
+	}
+
+	return result;
+}
+
+int png_write_end(png_t* png)
+{
+	int result = PNG_NO_ERROR;
+	double start = png->stats ? png_now() : 0.0;
+
+	if(png->zs)
+	{
+		/* only complete the image if every scanline was written */
+		if(png->row_index == png->height)
+		{
+			result = png_deflate(png, Z_FINISH);
+			if(result == PNG_NO_ERROR)
+				result = png_write_iend(png);
+		}
+		else
+		{
+			result = PNG_WRONG_ARGUMENTS;
+		}
+
+		png_end_deflate(png);
+		png->zs = NULL;
+	}
+	else if(png->pz)
+	{
+		if(png->row_index == png->height)
+		{
+			result = png_parallel_flush(png, 1);
+			if(result == PNG_NO_ERROR)
+				result = png_write_iend(png);
+		}
+		else
+		{
+			result = PNG_WRONG_ARGUMENTS;
+		}
+
+		png_end_parallel(png);
+	}
+
+	if(png->stats)
+	{
+		png->stats->deflate_time += png_now() - start;
+		png->stats->bytes_written += png->io_bytes;
+		png->io_bytes = 0;
+	}
+
+	png_free(png->row_buf);
+	png_free(png->filter_buf);
+	png_free(png->row_window);
+	png_free(png->chunk_buf);
+	png->row_buf = NULL;
+	png->filter_buf = NULL;
+	png->row_window = NULL;
+	png->chunk_buf = NULL;
+
+	return result;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
@@ -73,6 +73,22 @@ enum
 	PNG_TRUECOLOR_ALPHA		= 6
 };
 
+/*
+	Filter types for scanlines written by png_write_row. PNG_FILTER_ADAPTIVE chooses, for each scanline, the
+	filter type with the smallest sum of absolute values of the filtered bytes taken as signed, which usually
+	compresses best.
+*/
+
+enum
+{
+	PNG_FILTER_NONE			= 0,
+	PNG_FILTER_SUB			= 1,
+	PNG_FILTER_UP			= 2,
+	PNG_FILTER_AVERAGE		= 3,
+	PNG_FILTER_PAETH		= 4,
+	PNG_FILTER_ADAPTIVE		= 5
+};
+
 /*
 	Typedefs for callbacks.
 */
@@ -80,8 +96,59 @@ enum
 typedef unsigned (*png_write_callback_t)(void* input, size_t size, size_t numel, void* user_pointer);
 typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel, void* user_pointer);
 typedef void (*png_free_t)(void* p);
+typedef void (*png_convert_row_t)(unsigned char* dst, const unsigned char* src, unsigned len);
 typedef void * (*png_alloc_t)(size_t s);
 
+/*
+	Compression settings for writing a png. Passing 0 instead of a pointer to options uses the defaults:
+	{ -1, 0, PNG_FILTER_ADAPTIVE, 1 }.
+
+	With more than one thread, the image data is split into blocks of 128 KiB which are compressed
+	concurrently (each using the preceding 32 KiB as its dictionary) and joined into a single zlib stream.
+	The output is the same for any number of threads greater than one, and compresses nearly as well as a
+	single stream.
+*/
+
+#define PNG_MAX_THREADS			1024
+
+typedef struct
+{
+	int				level;				/* zlib compression level, 0 (none) to 9 (best), or -1 for zlib's default */
+	int				strategy;			/* zlib strategy (Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED) */
+	int				filter;				/* filter type for scanlines, one of the PNG_FILTER_* values */
+	int				threads;			/* number of threads compressing the image data (0 or 1 for none but the caller's) */
+} png_write_options_t;
+
+/*
+	zlib streams kept between pngs, so that reading or writing many pngs in a row does not set up a new
+	stream for each of them. See png_set_streams. Must be zeroed before first use.
+*/
+
+typedef struct
+{
+	void*				inflate_zs;			/* idle inflate stream, or NULL */
+	void*				deflate_zs;			/* idle deflate stream, or NULL */
+	int				level;				/* compression level of deflate_zs */
+	int				strategy;			/* zlib strategy of deflate_zs */
+} png_streams_t;
+
+/*
+	Time spent in each stage of reading or writing pngs, in seconds, and the amount of png data read or
+	written. See png_set_stats. The counts accumulate over every png the same png_stats_t is set on; zero it
+	before first use.
+*/
+
+typedef struct
+{
+	double				inflate_time;			/* reading and decompressing image data */
+	double				unfilter_time;			/* undoing scanline filters */
+	double				convert_time;			/* in the convert function of png_write_row_converted */
+	double				filter_time;			/* choosing and applying scanline filters */
+	double				deflate_time;			/* compressing and writing image data */
+	size_t				bytes_read;			/* bytes of png data read, including the header */
+	size_t				bytes_written;			/* bytes of png data written */
+} png_stats_t;
+
 typedef struct
 {
 	void*				zs;				/* pointer to z_stream */
@@ -90,7 +157,7 @@ typedef struct
 	void*				user_pointer;
 
 	unsigned char*			png_data;
-	unsigned			png_datalen;
+	size_t				png_datalen;
 
 	unsigned			width;
 	unsigned			height;
@@ -103,6 +170,25 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	const unsigned char*		mem;				/* png being read from memory, if opened with png_open_mem_read */
+	size_t				mem_size;
+	size_t				mem_pos;			/* offset of the next byte to read from mem */
+
+	unsigned char*			row_buf;			/* filtered scanline being read, including the filter byte */
+	unsigned char*			row_window;			/* current and previous unfiltered scanlines */
+	unsigned			row_index;			/* number of scanlines read so far */
+	unsigned			idat_left;			/* unread bytes of the current IDAT chunk */
+	unsigned			idat_crc;			/* running CRC of the current IDAT chunk */
+	unsigned char*			chunk_buf;			/* IDAT chunk being written, starting with the chunk type */
+	unsigned char*			filter_buf;			/* scanline being tried with another filter type */
+	int				filter;				/* filter type for scanlines written */
+	void*				pz;				/* state of the parallel encoder, if used */
+	int				level;				/* compression level of zs */
+	int				strategy;			/* zlib strategy of zs */
+	png_streams_t*			streams;			/* where zs is taken from and returned to, if set */
+	png_stats_t*			stats;				/* where the time spent and bytes are added, if set */
+	size_t				io_bytes;			/* bytes read or written so far */
 } png_t;
 
 /*
@@ -174,6 +260,64 @@ int png_open(png_t* png, png_read_callback_t read_fun, void* user_pointer);
 int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer);
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer);
 
+/*
+	Function: png_open_mem_read
+
+	This function opens a png held in memory (for example, a memory-mapped file) for reading. The compressed
+	image data is inflated straight from the memory, without being copied. The memory must remain valid until
+	the png is no longer used; png_close_file must not be called.
+
+	Parameters:
+		png - Empty png_t struct.
+		data - The contents of the png file.
+		size - Size of the png file in bytes.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_mem_read(png_t* png, const void* data, size_t size);
+
+/*
+	Function: png_set_streams
+
+	This function makes an opened png take its zlib stream from streams, if an idle one with the same settings
+	is available there, and return it to streams when it is done. The output is the same as with a new stream.
+	Call it after opening the png and before png_read_begin or png_write_begin. The same png_streams_t must
+	not be used by more than one thread at a time.
+
+	Parameters:
+		png - png_t struct opened with one of the png_open functions.
+		streams - Streams to reuse.
+*/
+
+void png_set_streams(png_t* png, png_streams_t* streams);
+
+/*
+	Function: png_free_streams
+
+	This function frees the idle zlib streams kept in streams.
+
+	Parameters:
+		streams - Streams passed to png_set_streams.
+*/
+
+void png_free_streams(png_streams_t* streams);
+
+/*
+	Function: png_set_stats
+
+	This function makes an opened png add the time spent reading or writing its image data, and the number of
+	bytes read or written, to stats. The bytes are added by png_read_end or png_write_end. Call it after
+	opening the png and before png_read_begin or png_write_begin.
+
+	Parameters:
+		png - png_t struct opened with one of the png_open functions.
+		stats - Statistics to add to, or 0 for none.
+*/
+
+void png_set_stats(png_t* png, png_stats_t* stats);
+
 /*
 	Function: png_print_info
 
@@ -215,8 +359,167 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_read_begin
+
+	This function prepares the opened png file to be decoded one scanline at a time with png_read_row. Only the
+	compressed data currently being inflated and a window of two scanlines are held in memory, so images of any
+	size can be decoded in bounded memory. png_read_end must be called when done, even if an error occurs.
+
+	Parameters:
+		png - png_t struct opened for reading.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_read_begin(png_t* png);
+
+/*
+	Function: png_read_row
+
+	This function decodes the next scanline, top to bottom. On success, row is set to point to the unfiltered
+	scanline (width*(bytes per pixel) bytes), which remains valid until the next call to png_read_row or png_read_end.
+
+	Parameters:
+		png - png_t struct passed to png_read_begin.
+		row - Where to store the pointer to the scanline.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_DONE if all scanlines have been read, otherwise an error code.
+*/
+
+int png_read_row(png_t* png, unsigned char** row);
+
+/*
+	Function: png_unfilter
+
+	This function undoes the filter of one scanline the way png_read_row does, or with the portable reference
+	functions only. It lets the specialized unfilter kernels be checked against the reference.
+
+	Parameters:
+		filter - Filter type of the scanline, one of PNG_FILTER_NONE to PNG_FILTER_PAETH.
+		bpp - Bytes per pixel.
+		in - The filtered scanline, without the filter type byte.
+		out - Where to store the unfiltered scanline (len bytes).
+		prev_line - The previous unfiltered scanline, or 0 for the first one.
+		len - Length of the scanline in bytes.
+		reference - Nonzero to use the reference functions even where png_read_row uses a specialized kernel.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_UNKNOWN_FILTER if the filter type is not known.
+*/
+
+int png_unfilter(int filter, int bpp, const unsigned char* in, unsigned char* out, const unsigned char* prev_line,
+		 unsigned len, int reference);
+
+/*
+	Function: png_read_end
+
+	This function releases the decoding state set up by png_read_begin.
+
+	Parameters:
+		png - png_t struct passed to png_read_begin.
+
+	Returns:
+		PNG_NO_ERROR
+*/
+
+int png_read_end(png_t* png);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_set_data_converted
+
+	Like png_set_data, but each row of data is passed through a conversion function as it is copied into the
+	buffer of the scanline to be compressed. This allows, for example, byteswapping the pixels without
+	making a separate converted copy of the image. The conversion function is called like memcpy:
+
+	> void (*png_convert_row_t)(unsigned char* dst, const unsigned char* src, unsigned len)
+
+	Parameters:
+		convert - Row conversion function, writing len bytes to dst from the len bytes at src.
+		options - Compression settings, or 0 for the defaults.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_data_converted(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data,
+			   png_convert_row_t convert, const png_write_options_t* options);
+
+/*
+	Function: png_write_begin
+
+	This function writes the header of a png opened for writing, and prepares it to be encoded one scanline at a
+	time with png_write_row. Scanlines are compressed as they are written and the compressed data is written out
+	in IDAT chunks of bounded size, so only a few scanlines and one chunk are held in memory. png_write_end must
+	be called when done, even if an error occurs.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		width - Width of the image.
+		height - Height of the image.
+		depth - Bit depth of the image.
+		color - Color type of the image.
+		options - Compression settings, or 0 for the defaults.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if an option is out of range, PNG_HEADER_ERROR if the width
+		or height is above 2^31 - 1, PNG_NOT_SUPPORTED if a scanline would be 2 GiB or more, otherwise an error
+		code. The same limits apply to pngs being read.
+*/
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color, const png_write_options_t* options);
+
+/*
+	Function: png_write_row
+
+	This function encodes the next scanline, top to bottom.
+
+	Parameters:
+		png - png_t struct passed to png_write_begin.
+		row - The scanline (width*(bytes per pixel) bytes).
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_DONE if all scanlines have already been written, otherwise an error code.
+*/
+
+int png_write_row(png_t* png, unsigned char* row);
+
+/*
+	Function: png_write_row_converted
+
+	Like png_write_row, but the scanline is passed through a conversion function (see png_set_data_converted)
+	as it is copied into the buffer of the scanline to be compressed.
+
+	Parameters:
+		png - png_t struct passed to png_write_begin.
+		row - The scanline to be converted.
+		convert - Row conversion function.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_DONE if all scanlines have already been written, otherwise an error code.
+*/
+
+int png_write_row_converted(png_t* png, unsigned char* row, png_convert_row_t convert);
+
+/*
+	Function: png_write_end
+
+	This function completes the compressed data and writes the end of the png, provided that every scanline
+	has been written, then releases the encoding state set up by png_write_begin.
+
+	Parameters:
+		png - png_t struct passed to png_write_begin.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_end(png_t* png);
+
 /*
 	Function: png_close_file
 